@@ -0,0 +1,193 @@
+// Generates the fixed benchmark inputs. Output depends only on the
+// arguments, so every run of a benchmark reads the same bytes.
+//
+//   gen eval N    N forms mixing arithmetic and list builtins, one per line
+//   gen lists N   N forms building, joining and popping long lists
+//   gen line N    about N bytes of random nested forms on a single line
+//   gen digits N  N numbers of 450 digits in one list on a single line
+//   gen symbols N N symbols of 250 characters in one list on a single line
+//   gen tokens N  1 MB of tokens of N characters, a '-' then digits, one per line
+//   gen deep N    (+ 1 (+ 1 ... 1)) nested N deep on a single line
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long gen_seed = 12345;
+
+static int gen_rand(int n) {
+  // Returns a pseudo-random number in [0, n)
+  gen_seed = gen_seed * 6364136223846793005UL + 1442695040888963407UL;
+  return (int)((gen_seed >> 33) % (unsigned long)n);
+}
+
+static void gen_num(void) {
+  printf("%d", gen_rand(199) - 99);
+}
+
+static void gen_expr(int depth) {
+  // Prints an expression evaluating to a number without error
+  if (depth == 0) { gen_num(); return; }
+
+  int n = 2 + gen_rand(3);
+  switch (gen_rand(6)) {
+    case 0:
+    case 1:
+      printf("(%c", "+-"[gen_rand(2)]);
+      for (int i = 0; i < n; i++) { putchar(' '); gen_expr(depth - 1); }
+      putchar(')');
+      break;
+    case 2:
+      printf("(* ");
+      gen_num();
+      putchar(' ');
+      gen_expr(depth - 1);
+      putchar(')');
+      break;
+    case 3:
+      printf("(head (list");
+      for (int i = 0; i < n; i++) { putchar(' '); gen_expr(depth - 1); }
+      printf("))");
+      break;
+    case 4:
+      printf("(eval {+ ");
+      gen_expr(depth - 1);
+      putchar(' ');
+      gen_expr(depth - 1);
+      printf("})");
+      break;
+    case 5:
+      printf("(head (tail (join (list ");
+      gen_expr(depth - 1);
+      printf(") (list");
+      for (int i = 0; i < n; i++) { putchar(' '); gen_expr(depth - 1); }
+      printf("))))");
+      break;
+  }
+}
+
+static void gen_items(int n) {
+  for (int i = 0; i < n; i++) { putchar(' '); gen_num(); }
+}
+
+static void gen_list(void) {
+  // Prints a form whose evaluation appends to and pops long lists
+  int n = 50 + gen_rand(450);
+  switch (gen_rand(4)) {
+    case 0:
+      printf("(list");
+      gen_items(n);
+      putchar(')');
+      break;
+    case 1:
+      printf("(join");
+      for (int i = 0, k = 2 + gen_rand(8); i < k; i++) {
+	printf(" {");
+	gen_items(n / k);
+	putchar('}');
+      }
+      putchar(')');
+      break;
+    case 2:
+      printf("(head (tail (tail (tail (list");
+      gen_items(n);
+      printf(")))))");
+      break;
+    case 3:
+      printf("(eval (join {+} (list");
+      gen_items(n);
+      printf(")))");
+      break;
+  }
+}
+
+static long gen_form(int depth) {
+  // Prints a random form of any shape, returning the bytes written
+  static const char* symbol = "abcxyz_+-*/\\=<>!&";
+  int r = gen_rand(depth > 0 ? 5 : 3);
+  long n = 0;
+
+  if (r == 0) { return printf("%d", gen_rand(2000001) - 1000000); }
+
+  if (r <= 2) {
+    for (int i = 0, k = 1 + gen_rand(8); i < k; i++) {
+      n += putchar(symbol[gen_rand(strlen(symbol))]) != EOF;
+    }
+    return n;
+  }
+
+  n += putchar(r == 3 ? '(' : '{') != EOF;
+  for (int i = 0, k = gen_rand(6); i < k; i++) {
+    if (i > 0) { n += putchar(' ') != EOF; }
+    n += gen_form(depth - 1);
+  }
+  n += putchar(r == 3 ? ')' : '}') != EOF;
+  return n;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: gen eval|lists|line|digits|symbols|tokens|deep N\n");
+    return 1;
+  }
+
+  long n = atol(argv[2]);
+
+  if (strcmp(argv[1], "eval") == 0) {
+    for (long i = 0; i < n; i++) {
+      gen_expr(1 + gen_rand(5));
+      putchar('\n');
+    }
+    return 0;
+  }
+
+  if (strcmp(argv[1], "lists") == 0) {
+    for (long i = 0; i < n; i++) {
+      gen_list();
+      putchar('\n');
+    }
+    return 0;
+  }
+
+  if (strcmp(argv[1], "line") == 0) {
+    for (long i = 0; i < n; i++) {
+      i += gen_form(4);
+      i += putchar(' ') != EOF;
+    }
+    putchar('\n');
+    return 0;
+  }
+
+  if (strcmp(argv[1], "digits") == 0 || strcmp(argv[1], "symbols") == 0) {
+    int digits = argv[1][0] == 'd';
+    putchar('{');
+    for (long i = 0; i < n; i++) {
+      putchar(' ');
+      for (int j = 0; j < (digits ? 450 : 250); j++) {
+	putchar(digits ? '0' + gen_rand(10) : 'a' + gen_rand(26));
+      }
+    }
+    printf("}\n");
+    return 0;
+  }
+
+  if (strcmp(argv[1], "tokens") == 0) {
+    for (long i = 0; i < (1 << 20); i += n + 1) {
+      putchar('-');
+      for (long j = 1; j < n; j++) { putchar('0' + gen_rand(10)); }
+      putchar('\n');
+    }
+    return 0;
+  }
+
+  if (strcmp(argv[1], "deep") == 0) {
+    for (long i = 0; i < n; i++) { printf("(+ 1 "); }
+    putchar('1');
+    for (long i = 0; i < n; i++) { putchar(')'); }
+    putchar('\n');
+    return 0;
+  }
+
+  fprintf(stderr, "gen: unknown input '%s'\n", argv[1]);
+  return 1;
+}
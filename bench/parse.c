@@ -0,0 +1,154 @@
+// Times mpc parsing the fixed benchmark inputs on its own, without the
+// evaluator around it. Results are printed on stderr.
+//
+//   parse re REGEX FILE   matches REGEX against each line of FILE in one parse
+//   parse lispy FILE HOW  parses FILE with the Lispy grammar, read in as a
+//                         string, or through mpc_parse_file or mpc_parse_pipe
+//
+// --regex-limit=N is passed on to mpc_re_limit, so --regex-limit=0 gives
+// the combinator baseline to compare the compiled regexes against, and
+// --packrat builds the Lispy grammar with MPCA_LANG_PACKRAT.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../mpc.h"
+
+static char* parse_slurp(const char* filename, long* length) {
+  // Reads the whole of filename, which the caller frees
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "parse: cannot open '%s'\n", filename);
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  *length = ftell(f);
+  rewind(f);
+  char* s = malloc(*length + 1);
+  s[fread(s, 1, *length, f)] = '\0';
+  fclose(f);
+  return s;
+}
+
+static mpc_val_t* parse_drop(int n, mpc_val_t** xs) {
+  for (int i = 0; i < n; i++) { free(xs[i]); }
+  return NULL;
+}
+
+static void parse_report(const char* what, clock_t start, long length) {
+  double us = (double)(clock() - start) * 1000000.0 / CLOCKS_PER_SEC;
+  fprintf(stderr, "%s: %.1f us, %.1f MB/s\n", what, us, length / (us > 0 ? us : 1));
+}
+
+static int parse_re(const char* re, const char* filename) {
+  long length;
+  char* input = parse_slurp(filename, &length);
+
+  mpc_parser_t* line = mpc_and(2, parse_drop, mpc_re(re), mpc_char('\n'), free);
+  mpc_parser_t* lines = mpc_total(mpc_many(parse_drop, line), free);
+
+  mpc_result_t r;
+  clock_t start = clock();
+  int ok = mpc_parse(filename, input, lines, &r);
+  parse_report(re, start, length);
+
+  if (!ok) {
+    mpc_err_print_to(r.error, stderr);
+    mpc_err_delete(r.error);
+  }
+
+  mpc_delete(lines);
+  free(input);
+  return ok ? 0 : 1;
+}
+
+static unsigned long parse_hash(mpc_ast_t* a, unsigned long h) {
+  // Hashes the tags and contents of a tree, to check every way of reading gives the same
+  for (const char* s = a->tag; *s; s++) { h = h * 31 + (unsigned char)*s; }
+  for (const char* s = a->contents; *s; s++) { h = h * 31 + (unsigned char)*s; }
+  for (int i = 0; i < a->children_num; i++) { h = parse_hash(a->children[i], h); }
+  return h;
+}
+
+static int parse_lispy(const char* filename, const char* how, int flags) {
+  mpc_parser_t* Number = mpc_new("number");
+  mpc_parser_t* Symbol = mpc_new("symbol");
+  mpc_parser_t* Sexpr  = mpc_new("sexpr");
+  mpc_parser_t* Qexpr  = mpc_new("qexpr");
+  mpc_parser_t* Expr   = mpc_new("expr");
+  mpc_parser_t* Lispy  = mpc_new("lispy");
+
+  // The grammar of evaluation.c
+  mpca_lang(flags, "number : /-?[0-9]+/ ;                        \
+                    symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
+                    sexpr  : '(' <expr>* ')' ;                   \
+                    qexpr  : '{' <expr>* '}' ;                   \
+                    expr   : <number> | <symbol> | <sexpr> |     \
+                             <qexpr>;                            \
+                    lispy  : /^/ <expr>* /$/ ;",
+	    Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  long length = 0;
+  char* input = NULL;
+  FILE* f = NULL;
+  mpc_result_t r;
+  int ok;
+  clock_t start;
+
+  if (strcmp(how, "string") == 0) {
+    input = parse_slurp(filename, &length);
+    start = clock();
+    ok = mpc_parse(filename, input, Lispy, &r);
+  } else {
+    f = fopen(filename, "rb");
+    if (f == NULL) {
+      fprintf(stderr, "parse: cannot open '%s'\n", filename);
+      exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    rewind(f);
+    start = clock();
+    ok = strcmp(how, "pipe") == 0
+      ? mpc_parse_pipe(filename, f, Lispy, &r)
+      : mpc_parse_file(filename, f, Lispy, &r);
+    fclose(f);
+  }
+
+  char what[64];
+  snprintf(what, sizeof(what), "lispy %s%s", how, flags & MPCA_LANG_PACKRAT ? " packrat" : "");
+  parse_report(what, start, length);
+
+  if (ok) {
+    fprintf(stderr, "tree hash: %lx\n", parse_hash(r.output, 0));
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print_to(r.error, stderr);
+    mpc_err_delete(r.error);
+  }
+
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  mpc_ast_cleanup();
+  free(input);
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+  int flags = MPCA_LANG_DEFAULT;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--regex-limit=", 14) == 0) {
+      mpc_re_limit(strtol(argv[i] + 14, NULL, 10));
+    }
+    if (strcmp(argv[i], "--packrat") == 0) { flags |= MPCA_LANG_PACKRAT; }
+  }
+
+  if (argc >= 4 && strcmp(argv[1], "re") == 0) { return parse_re(argv[2], argv[3]); }
+  if (argc >= 4 && strcmp(argv[1], "lispy") == 0) { return parse_lispy(argv[2], argv[3], flags); }
+
+  fprintf(stderr, "usage: parse re REGEX FILE [--regex-limit=N]\n");
+  fprintf(stderr, "       parse lispy FILE string|file|pipe [--packrat]\n");
+  return 1;
+}
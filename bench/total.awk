@@ -0,0 +1,9 @@
+# Adds up the per-line --stats output of the REPL into one line per figure.
+
+/^allocs:/ { allocs += $2; mallocs += $5 }
+/^eval:/ { eval += $2; evals++ }
+
+END {
+  if (evals) { printf "eval: %.1f ms\n", eval / 1000 }
+  printf "allocs: %d, system allocs: %d\n", allocs, mallocs
+}
@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include "mpc.h"
 
 /* if compiling for Windows, compile these functions */
@@ -32,29 +35,362 @@ void add_history(char* unused) {};
   if (!(cond)) { lval_del(args); return lval_err(err); }
 
 
+// An interned symbol name, shared by every symbol lval spelling it
+typedef struct lsym {
+  char* name;
+  int id;  // dense, in order of first appearance
+  unsigned hash;
+  struct lsym* next;  // next in hash bucket
+} lsym;
+
 // Declare a Lisp Value struct
 typedef struct lval {
   int type;
   long num;
   char* err; // error strings
-  char* sym; // symbols
+  lsym* sym; // symbols
   
   int count; // count of child lvals
   struct lval** cell;  // pointer to list of pointers to lvals
+  int cap;   // slots allocated from cell onwards
+  int skip;  // slots popped off the front, still allocated before cell
   
 } lval;
 
 // enumeration of possible lval types
 enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR };
 
+// Numbers that fit in 63 bits are not allocated at all: they are stored
+// shifted left in the lval pointer itself with the low bit set, which a
+// real (aligned) lval pointer never has. Only numbers outside that range
+// get a heap LVAL_NUM. Always read types and numbers through lval_type
+// and lval_get_num.
+#define LVAL_FIX_MIN (LONG_MIN / 2)
+#define LVAL_FIX_MAX (LONG_MAX / 2)
+
+static inline int lval_is_fix(lval* v) { return (uintptr_t)v & 1; }
+
+static inline int lval_type(lval* v) {
+  return lval_is_fix(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lval_get_num(lval* v) {
+  return lval_is_fix(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
 // forward declarations
 void lval_print(lval* v);
 lval* lval_eval(lval* v);
-lval* builtin_op(lval*, char*);
+lval* lval_vm_eval(lval* v);
+lval* builtin_op(lval*, char);
+void lval_del(lval* v);
+
+// evaluation engines, picked at startup with --engine
+enum { ENGINE_VM, ENGINE_TREE, ENGINE_BOTH };
+static int lval_engine = ENGINE_VM;
+
+// readers, picked at startup with --reader
+enum { READER_DIRECT, READER_MPC, READER_BOTH };
+static int lval_reader = READER_DIRECT;
+
+// allocation counters, reported per line with --stats
+struct {
+  long allocs;   // lvals and payloads handed out
+  long mallocs;  // calls into the system allocator
+} lval_stats;
+
+// lvals and their payloads (error/symbol strings, cell arrays) are carved
+// out of large chunks. Freed structs and payloads go on free lists (one
+// per size class) for reuse within the line, and lval_reset releases
+// everything at once when the line is done. Build with -DLVAL_MALLOC to
+// get plain malloc/free instead, e.g. when debugging with valgrind.
+
+#define LVAL_CHUNK_SIZE (256 * 1024)
+#define LVAL_CHUNKS_KEPT 4  // chunks lval_reset keeps for the next line
+#define LVAL_MIN_CLASS 16
+#define LVAL_CLASSES 8  // 16, 32, ... 2048 bytes
+
+#ifndef LVAL_MALLOC
+
+typedef struct lchunk {
+  struct lchunk* next;
+  size_t used;
+} lchunk;
+
+// payloads bigger than the largest class are malloc'd and linked here
+typedef struct lbig {
+  struct lbig* prev;
+  struct lbig* next;
+} lbig;
+
+static lchunk* lval_chunks = NULL;  // all chunks, in carving order
+static lchunk* lval_chunk = NULL;   // chunk currently being carved up
+static lbig* lval_bigs = NULL;
+static lval* lval_free_structs = NULL;
+static void* lval_free_blocks[LVAL_CLASSES];
+
+static void* lval_carve(size_t n) {
+  // bump allocate n bytes (a multiple of 8) from the current chunk
+
+  if (lval_chunk == NULL || lval_chunk->used + n > LVAL_CHUNK_SIZE) {
+    if (lval_chunk && lval_chunk->next) {
+      lval_chunk = lval_chunk->next;
+    } else {
+      lchunk* c = malloc(sizeof(lchunk) + LVAL_CHUNK_SIZE);
+      lval_stats.mallocs++;
+      c->next = NULL;
+      if (lval_chunk) { lval_chunk->next = c; } else { lval_chunks = c; }
+      lval_chunk = c;
+    }
+    lval_chunk->used = 0;
+  }
+
+  void* p = (char*)(lval_chunk + 1) + lval_chunk->used;
+  lval_chunk->used += n;
+  return p;
+}
+
+static int lval_class(size_t n) {
+  // smallest size class holding n bytes, or -1 if too big
+  size_t size = LVAL_MIN_CLASS;
+  for (int c = 0; c < LVAL_CLASSES; c++, size *= 2) {
+    if (n <= size) { return c; }
+  }
+  return -1;
+}
+
+#endif
+
+lval* lval_new(void) {
+  // Returns uninitialised storage for one lval
+  lval_stats.allocs++;
+
+#ifdef LVAL_MALLOC
+  lval_stats.mallocs++;
+  return malloc(sizeof(lval));
+#else
+  lval* v = lval_free_structs;
+  if (v) {
+    lval_free_structs = *(lval**)v;
+    return v;
+  }
+  return lval_carve((sizeof(lval) + 7) & ~(size_t)7);
+#endif
+}
+
+void lval_free(lval* v) {
+#ifdef LVAL_MALLOC
+  free(v);
+#else
+  *(lval**)v = lval_free_structs;
+  lval_free_structs = v;
+#endif
+}
+
+void* lval_alloc(size_t n) {
+  // Returns n bytes of payload storage
+  lval_stats.allocs++;
+
+#ifdef LVAL_MALLOC
+  lval_stats.mallocs++;
+  return malloc(n);
+#else
+  // every block is preceded by its size
+  int c = lval_class(n);
+  if (c < 0) {
+    lbig* b = malloc(sizeof(lbig) + sizeof(size_t) + n);
+    lval_stats.mallocs++;
+    b->prev = NULL;
+    b->next = lval_bigs;
+    if (lval_bigs) { lval_bigs->prev = b; }
+    lval_bigs = b;
+    size_t* h = (size_t*)(b + 1);
+    *h = n;
+    return h + 1;
+  }
+
+  size_t* h = lval_free_blocks[c];
+  if (h) {
+    lval_free_blocks[c] = *(void**)h;
+  } else {
+    h = lval_carve(sizeof(size_t) + ((size_t)LVAL_MIN_CLASS << c));
+  }
+  *h = (size_t)LVAL_MIN_CLASS << c;
+  return h + 1;
+#endif
+}
+
+void lval_dealloc(void* p) {
+  // Releases storage from lval_alloc
+  if (p == NULL) { return; }
+
+#ifdef LVAL_MALLOC
+  free(p);
+#else
+  size_t* h = (size_t*)p - 1;
+  int c = lval_class(*h);
+  if (c < 0) {
+    lbig* b = (lbig*)h - 1;
+    if (b->prev) { b->prev->next = b->next; } else { lval_bigs = b->next; }
+    if (b->next) { b->next->prev = b->prev; }
+    free(b);
+    return;
+  }
+  *(void**)h = lval_free_blocks[c];
+  lval_free_blocks[c] = h;
+#endif
+}
+
+void* lval_realloc(void* p, size_t n) {
+  // Resizes storage from lval_alloc
+#ifdef LVAL_MALLOC
+  if (p == NULL) { lval_stats.allocs++; }
+  lval_stats.mallocs++;
+  return realloc(p, n);
+#else
+  if (p == NULL) { return lval_alloc(n); }
+
+  size_t old = ((size_t*)p)[-1];
+  int c = lval_class(n);
+  if (c < 0 ? n <= old : c == lval_class(old)) { return p; }
+
+  if (c < 0 && lval_class(old) < 0) {
+    // oversize to oversize, let the system allocator move it
+    lbig* b = realloc((lbig*)((size_t*)p - 1) - 1,
+		      sizeof(lbig) + sizeof(size_t) + n);
+    lval_stats.mallocs++;
+    if (b->prev) { b->prev->next = b; } else { lval_bigs = b; }
+    if (b->next) { b->next->prev = b; }
+    size_t* h = (size_t*)(b + 1);
+    *h = n;
+    return h + 1;
+  }
+
+  void* q = lval_alloc(n);
+  memcpy(q, p, old < n ? old : n);
+  lval_dealloc(p);
+  return q;
+#endif
+}
+
+char* lval_strdup(char* s) {
+  char* d = lval_alloc(strlen(s) + 1);
+  strcpy(d, s);
+  return d;
+}
+
+void lval_reset(lval* x) {
+  // Releases x, and in arena builds everything else allocated since the
+  // last reset. Called once the result of a line has been printed.
+
+#ifdef LVAL_MALLOC
+  lval_del(x);
+#else
+  (void) x;
+
+  while (lval_bigs) {
+    lbig* b = lval_bigs;
+    lval_bigs = b->next;
+    free(b);
+  }
+
+  // keep only the first few chunks, so one huge line does not pin its
+  // peak memory for the rest of the session
+  lchunk* c = lval_chunks;
+  for (int n = 1; c && n < LVAL_CHUNKS_KEPT; n++) { c = c->next; }
+  while (c && c->next) {
+    lchunk* d = c->next;
+    c->next = d->next;
+    free(d);
+  }
+
+  lval_chunk = lval_chunks;
+  if (lval_chunk) { lval_chunk->used = 0; }
+  lval_free_structs = NULL;
+  for (int c = 0; c < LVAL_CLASSES; c++) { lval_free_blocks[c] = NULL; }
+#endif
+}
+
+// Symbol table. Names are interned once for the life of the process
+// (outside the lval arena), so symbols compare by pointer and need no
+// freeing. Size and hit rate are shown by --stats.
+
+struct {
+  int size;      // distinct symbols
+  long lookups;  // calls to lsym_intern
+  long hits;     // lookups that found an existing symbol
+} lsym_stats;
+
+static lsym** lsym_buckets = NULL;
+static int lsym_nbuckets = 0;
+
+static unsigned lsym_hash(char* s, int n) {
+  // FNV-1a
+  unsigned h = 2166136261u;
+  for (int i = 0; i < n; i++) { h = (h ^ (unsigned char)s[i]) * 16777619u; }
+  return h;
+}
+
+static void lsym_grow(void) {
+  // doubles the bucket array and rehashes
+  int n = lsym_nbuckets ? lsym_nbuckets * 2 : 64;
+  lsym** b = calloc(n, sizeof(lsym*));
+
+  for (int i = 0; i < lsym_nbuckets; i++) {
+    lsym* s = lsym_buckets[i];
+    while (s) {
+      lsym* next = s->next;
+      s->next = b[s->hash & (n-1)];
+      b[s->hash & (n-1)] = s;
+      s = next;
+    }
+  }
+
+  free(lsym_buckets);
+  lsym_buckets = b;
+  lsym_nbuckets = n;
+}
+
+lsym* lsym_intern_n(char* name, int n) {
+  // Returns the unique symbol called by the first n chars of name,
+  // adding it if new
+  lsym_stats.lookups++;
+
+  unsigned h = lsym_hash(name, n);
+  if (lsym_nbuckets) {
+    for (lsym* s = lsym_buckets[h & (lsym_nbuckets-1)]; s; s = s->next) {
+      if (s->hash == h && strncmp(s->name, name, n) == 0 && !s->name[n]) {
+	lsym_stats.hits++;
+	return s;
+      }
+    }
+  }
+
+  if (lsym_stats.size >= lsym_nbuckets * 3 / 4) { lsym_grow(); }
+
+  lsym* s = malloc(sizeof(lsym));
+  s->name = malloc(n + 1);
+  memcpy(s->name, name, n);
+  s->name[n] = '\0';
+  s->id = lsym_stats.size++;
+  s->hash = h;
+  s->next = lsym_buckets[h & (lsym_nbuckets-1)];
+  lsym_buckets[h & (lsym_nbuckets-1)] = s;
+  return s;
+}
+
+lsym* lsym_intern(char* name) {
+  // Returns the unique symbol called name, adding it if new
+  return lsym_intern_n(name, strlen(name));
+}
 
 // create pointer to a new number lval
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
+  if (x >= LVAL_FIX_MIN && x <= LVAL_FIX_MAX) {
+    return (lval*)(((uintptr_t)x << 1) | 1);
+  }
+
+  lval* v = lval_new();
   v->type = LVAL_NUM;
   v->num = x;
   return v;
@@ -62,71 +398,133 @@ lval* lval_num(long x) {
 
 // create a pointer to a new error lval
 lval* lval_err(char* m) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_new();
   v->type = LVAL_ERR;
-  v->err = malloc(strlen(m) + 1);
-  strcpy(v->err, m);
+  v->err = lval_strdup(m);
   return v;
 }
 
-// create a pointer to a new symbol lval
-lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
+// create a pointer to a new symbol lval named by the first n chars of s
+lval* lval_sym_n(char* s, int n) {
+  lval* v = lval_new();
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  v->sym = lsym_intern_n(s, n);
   return v;
 }
 
+// create a pointer to a new symbol lval
+lval* lval_sym(char* s) {
+  return lval_sym_n(s, strlen(s));
+}
+
 // create a pointer to a new empty sexpr lval
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_new();
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->cap = 0;
+  v->skip = 0;
   return v;
 }
 
 // create a pointer to a new empty qexpr lval
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_new();
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->cap = 0;
+  v->skip = 0;
   return v;
 }
 
-// free lval types
-void lval_del(lval* v) {
-  switch (v->type) {
-    
-    
-  case LVAL_NUM:
-    // do nothing special for lval number type
-    break;
+// Deleting, printing, copying, comparing and evaluating lvals walk the
+// tree with explicit work stacks on the heap instead of recursing, so
+// nesting depth is limited by memory rather than by the C stack. A walk
+// notes the stack height it started at and stops when it gets back
+// there, which keeps walks started from inside another walk apart. The
+// stack moves when it grows: hold on to indices into it, not pointers.
+typedef struct lframe {
+  lval* v;  // list being walked
+  lval* x;  // its counterpart (copy target, other side of a compare)
+  int i;    // next element of v
+} lframe;
+
+static lframe* lval_frames = NULL;
+static int lval_frames_num = 0;
+static int lval_frames_slots = 0;
+
+// bytes each evaluation stack may grow to before the evaluation fails
+// with an error, set with --stack-limit. The frames above and the VM's
+// values and frames are each held to it. The VM keeps a call's arguments
+// on its value stack where the tree-walker evaluates them in place, so a
+// call with more than a limit's worth of arguments only fails in the VM.
+static size_t lval_stack_limit = 256 * 1024 * 1024;
+
+static lframe* lval_frame_push(lval* v, lval* x) {
+  if (lval_frames_num == lval_frames_slots) {
+    lval_frames_slots = lval_frames_slots ? lval_frames_slots * 2 : 64;
+    lval_frames = realloc(lval_frames, sizeof(lframe) * lval_frames_slots);
+  }
+  lframe* f = &lval_frames[lval_frames_num++];
+  f->v = v;
+  f->x = x;
+  f->i = 0;
+  return f;
+}
 
-  case LVAL_ERR:
-    free(v->err);
-    break;
+// lvals waiting to be deleted by lval_del
+static lval** lval_dels = NULL;
+static int lval_dels_num = 0;
+static int lval_dels_slots = 0;
 
-  case LVAL_SYM:
-    free(v->sym);
-    break;
+// free lval types
+void lval_del(lval* v) {
+  int base = lval_dels_num;
+
+  for (;;) {
+    if (!lval_is_fix(v)) {
+      switch (v->type) {
+
+      case LVAL_NUM:
+	// do nothing special for lval number type
+	break;
+
+      case LVAL_ERR:
+	lval_dealloc(v->err);
+	break;
+
+      case LVAL_SYM:
+	// symbol names are interned, nothing to free
+	break;
+
+      case LVAL_QEXPR:
+      case LVAL_SEXPR:
+	// queue all child elements for deletion
+	if (lval_dels_num + v->count > lval_dels_slots) {
+	  while (lval_dels_num + v->count > lval_dels_slots) {
+	    lval_dels_slots = lval_dels_slots ? lval_dels_slots * 2 : 64;
+	  }
+	  lval_dels = realloc(lval_dels, sizeof(lval*) * lval_dels_slots);
+	}
+	if (v->count) {
+	  memcpy(lval_dels + lval_dels_num, v->cell, sizeof(lval*) * v->count);
+	  lval_dels_num += v->count;
+	}
+
+	// free memory allocated to the pointers
+	lval_dealloc(v->cell - v->skip);
+	break;
+      }
 
-  case LVAL_QEXPR:
-  case LVAL_SEXPR:
-    // delete all child elements
-    for (int i = 0; i < v->count; i++) {
-      lval_del(v->cell[i]);
+      // free memory allocated to the lval struct itself
+      lval_free(v);
     }
 
-    // free memory allocated to the pointers
-    free(v->cell);
-    break;
+    if (lval_dels_num == base) { return; }
+    v = lval_dels[--lval_dels_num];
   }
-
-  // free memory allocated to the lval struct itself
-  free(v);
 }
 
 // return lval number (or error)
@@ -136,71 +534,240 @@ lval* lval_read_num(mpc_ast_t* t) {
   return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
 }
 
+void lval_reserve(lval* v, int n) {
+  // Makes room for n more children in sexpr `v'
+
+  if (v->count + n <= v->cap) { return; }
+
+  // reclaim the slots popped off the front first
+  if (v->skip) {
+    memmove(v->cell - v->skip, v->cell, sizeof(lval*) * v->count);
+    v->cell -= v->skip;
+    v->cap += v->skip;
+    v->skip = 0;
+    if (v->count + n <= v->cap) { return; }
+  }
+
+  // grow geometrically so repeated adds are amortized O(1)
+  int cap = v->cap ? v->cap * 2 : 4;
+  if (cap < v->count + n) { cap = v->count + n; }
+  v->cell = lval_realloc(v->cell, sizeof(lval*) * cap);
+  v->cap = cap;
+}
+
 lval* lval_add(lval* v, lval* x) {
   // Adds a new element to sexpr pointed by `v'
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count-1] = x;
+  lval_reserve(v, 1);
+  v->cell[v->count++] = x;
   return v;
 }
 
+// Interned ids of the grammar's tags, so reading a node tests ints
+static int ltag_number, ltag_symbol, ltag_sexpr, ltag_qexpr, ltag_root, ltag_regex, ltag_ws;
+
+static void ltag_init(void) {
+  ltag_number = mpc_tag_id("number");
+  ltag_symbol = mpc_tag_id("symbol");
+  ltag_sexpr = mpc_tag_id("sexpr");
+  ltag_qexpr = mpc_tag_id("qexpr");
+  ltag_root = mpc_tag_id(">");
+  ltag_regex = mpc_tag_id("regex");
+  ltag_ws = mpc_tag_id("ws");
+}
+
+static int lval_read_skip(mpc_ast_t* t) {
+  // Returns whether AST child t is punctuation or whitespace rather than
+  // an expression
+  if (strcmp(t->contents, "(") ==  0) { return 1; }
+  if (strcmp(t->contents, ")") ==  0) { return 1; }
+  if (strcmp(t->contents, "{") ==  0) { return 1; }
+  if (strcmp(t->contents, "}") ==  0) { return 1; }
+  if (mpc_ast_tag_id(t) == ltag_regex) { return 1; }
+  if (mpc_ast_has_tag(t, ltag_ws)) { return 1; }
+  return 0;
+}
+
 lval* lval_read(mpc_ast_t* t) {
-  // Returns t converted to an lval
+  // Returns t converted to an lval. Lists still being filled are kept on
+  // a stack of their own, as the frames hold AST nodes rather than lvals.
+  struct { mpc_ast_t* t; lval* x; int i; }* stack = NULL;
+  int num = 0;
+  int slots = 0;
+
+  for (;;) {
+    lval* x = NULL;
+
+    // if symbol or number, convert to that type
+    if (mpc_ast_has_tag(t, ltag_number)) {
+      x = lval_read_num(t);
+    } else if (mpc_ast_has_tag(t, ltag_symbol)) {
+      x = lval_sym(t->contents);
+    } else {
+      // if root (>) or sexpr or qexpr, create empty list
+      lval* l = NULL;
+      if (mpc_ast_tag_id(t) == ltag_root) { l = lval_sexpr(); }
+      if (mpc_ast_has_tag(t, ltag_sexpr)) { l = lval_sexpr(); }
+      if (mpc_ast_has_tag(t, ltag_qexpr)) { l = lval_qexpr(); }
+
+      // children_num bounds the element count, so size the cells once
+      lval_reserve(l, t->children_num);
+
+      if (num == slots) {
+	slots = slots ? slots * 2 : 16;
+	stack = realloc(stack, sizeof(*stack) * slots);
+      }
+      stack[num].t = t;
+      stack[num].x = l;
+      stack[num].i = 0;
+      num++;
+    }
 
-  // if symbol or number, return conversion to that type
-  if (strstr(t->tag, "number")) {
-    return lval_read_num(t);
-  }
-  
-  if (strstr(t->tag, "symbol")) {
-    return lval_sym(t->contents);
-  }
+    // add finished values to their list, closing lists that are full,
+    // until there is another child to read
+    for (;;) {
+      if (x) {
+	if (num == 0) {
+	  free(stack);
+	  return x;
+	}
+	lval_add(stack[num-1].x, x);
+      }
 
-  // if root (>) or sexpr or qexpr, create empty list
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+      mpc_ast_t* p = stack[num-1].t;
+      int i = stack[num-1].i;
+      while (i < p->children_num && lval_read_skip(p->children[i])) { i++; }
 
-  // fill the created list with any valid expressions contained within
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") ==  0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") ==  0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") ==  0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") ==  0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") ==  0) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
-  }
+      if (i < p->children_num) {
+	stack[num-1].i = i + 1;
+	t = p->children[i];
+	break;
+      }
 
-  return x;
-  
+      x = stack[--num].x;
+    }
+  }
 }
 
+// Direct reader
+//
+// lval_read_str reads Lispy source straight into lvals in a single pass
+// over the buffer, with no mpc AST in between. It accepts exactly what
+// the `lispy' grammar in main does: numbers are tried before symbols, so
+// "12ab" is 12 followed by ab, and whitespace may sit between any two
+// tokens. --reader=mpc goes through the grammar and lval_read instead,
+// and --reader=both checks the two against each other.
+
+static int lval_read_space(char c) {
+  return c && strchr(" \f\n\r\t\v", c);
+}
 
+static int lval_read_digit(char c) {
+  return c >= '0' && c <= '9';
+}
 
-void lval_expr_print(lval* v, char open, char close) {
-  // prints an sexpr's children
-  
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-    // print value contained within
-    lval_print(v->cell[i]);
+static int lval_read_symbol(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+    || lval_read_digit(c) || (c && strchr("_+-*/\\=<>!&", c));
+}
 
-    // Only print trailing space if not last element
-    if (i != (v->count-1)) {
-      putchar(' ');
+int lval_read_str(char* filename, char* s, lval** r) {
+  // Reads every expression in s into an sexpr stored at r. Returns 0 on
+  // a syntax error, with r set to an error describing it.
+
+  // lists still open, innermost last; x is the one being filled
+  lval** stack = NULL;
+  int num = 0;
+  int slots = 0;
+  lval* x = lval_sexpr();
+  char* p = s;
+
+  for (;;) {
+    while (lval_read_space(*p)) { p++; }
+
+    lval* v;
+    if (lval_read_digit(*p) || (*p == '-' && lval_read_digit(p[1]))) {
+      errno = 0;
+      long n = strtol(p, &p, 10);
+      v = errno != ERANGE ? lval_num(n) : lval_err("invalid number");
+    } else if (lval_read_symbol(*p)) {
+      char* start = p;
+      while (lval_read_symbol(*p)) { p++; }
+      v = lval_sym_n(start, p - start);
+    } else if (*p == '(' || *p == '{') {
+      if (num == slots) {
+	slots = slots ? slots * 2 : 16;
+	stack = realloc(stack, sizeof(lval*) * slots);
+      }
+      stack[num++] = x;
+      x = *p++ == '(' ? lval_sexpr() : lval_qexpr();
+      continue;
+    } else if (num && *p == (x->type == LVAL_SEXPR ? ')' : '}')) {
+      p++;
+      v = x;
+      x = stack[--num];
+    } else if (!num && !*p) {
+      free(stack);
+      *r = x;
+      return 1;
+    } else {
+      break;
     }
+
+    lval_add(x, v);
   }
-  putchar(close);
+
+  // syntax error, report where in the same form as mpc
+  int row = 1;
+  char* line = s;
+  for (char* q = s; q < p; q++) {
+    if (*q == '\n') { row++; line = q + 1; }
+  }
+
+  char at[16];
+  if (*p) { snprintf(at, sizeof(at), "'%c'", *p); }
+  else    { snprintf(at, sizeof(at), "end of input"); }
+
+  char msg[512];
+  snprintf(msg, sizeof(msg), "%s:%d:%d: error: expected expression or %s at %s",
+	   filename, row, (int)(p - line) + 1,
+	   !num ? "end of input" : x->type == LVAL_SEXPR ? "')'" : "'}'", at);
+
+  lval_del(x);
+  while (num) { lval_del(stack[--num]); }
+  free(stack);
+  *r = lval_err(msg);
+  return 0;
 }
 
 void lval_print(lval* v) {
-  switch (v->type) {
-  case LVAL_NUM: printf("%li", v->num); break;
-  case LVAL_ERR: printf("Error: %s", v->err); break;
-  case LVAL_SYM: printf("%s", v->sym); break;
-  case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-  case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+  // prints v, keeping a frame for each list still open
+
+  int base = lval_frames_num;
+
+  for (;;) {
+    switch (lval_type(v)) {
+    case LVAL_NUM: printf("%li", lval_get_num(v)); break;
+    case LVAL_ERR: printf("Error: %s", v->err); break;
+    case LVAL_SYM: printf("%s", v->sym->name); break;
+    case LVAL_SEXPR: putchar('('); lval_frame_push(v, NULL); break;
+    case LVAL_QEXPR: putchar('{'); lval_frame_push(v, NULL); break;
+    }
+
+    // close finished lists, then move on to the next element
+    for (;;) {
+      if (lval_frames_num == base) { return; }
+
+      lframe* f = &lval_frames[lval_frames_num-1];
+      if (f->i < f->v->count) {
+	// Only print a space between elements
+	if (f->i) { putchar(' '); }
+	v = f->v->cell[f->i++];
+	break;
+      }
+
+      putchar(f->v->type == LVAL_SEXPR ? ')' : '}');
+      lval_frames_num--;
+    }
   }
 }
 
@@ -213,17 +780,24 @@ lval* lval_pop(lval* v, int i) {
 
   lval* x = v->cell[i];
 
+  // popping the front just slides the start of the slice along, so
+  // draining a list from the front is linear
+  if (i == 0) {
+    v->cell++;
+    v->cap--;
+    v->skip++;
+    v->count--;
+    return x;
+  }
+
   // shift cell items backwards
   
   memmove(&v->cell[i],   // dest
 	  &v->cell[i+1], // src
 	  sizeof(lval*) * (v->count-i-1) ); // size
 
-  // decrease count
+  // decrease count, keeping the slot for later adds
   v->count--;
-
-  // Reallocate memory used
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
   return x;
 }
 
@@ -237,13 +811,101 @@ lval* lval_take(lval* v, int i) {
 }
 
 
+static lval* lval_copy_shell(lval* v) {
+  // Returns a copy of v whose cells (if any) are left for the caller
+  if (lval_is_fix(v)) { return v; }
+
+  lval* x = lval_new();
+  x->type = v->type;
+
+  switch (v->type) {
+  case LVAL_NUM: x->num = v->num; break;
+  case LVAL_ERR: x->err = lval_strdup(v->err); break;
+  case LVAL_SYM: x->sym = v->sym; break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    x->count = v->count;
+    x->cell = v->count ? lval_alloc(sizeof(lval*) * v->count) : NULL;
+    x->cap = v->count;
+    x->skip = 0;
+    break;
+  }
+  return x;
+}
+
+lval* lval_copy(lval* v) {
+  // Returns a deep copy of v
+  int base = lval_frames_num;
+
+  lval* x = lval_copy_shell(v);
+  if (lval_type(v) == LVAL_SEXPR || lval_type(v) == LVAL_QEXPR) {
+    lval_frame_push(v, x);
+  }
+
+  while (lval_frames_num > base) {
+    lframe* f = &lval_frames[lval_frames_num-1];
+    if (f->i == f->v->count) {
+      lval_frames_num--;
+      continue;
+    }
+
+    lval* c = f->v->cell[f->i];
+    lval* y = lval_copy_shell(c);
+    f->x->cell[f->i++] = y;
+    if (lval_type(c) == LVAL_SEXPR || lval_type(c) == LVAL_QEXPR) {
+      lval_frame_push(c, y);
+    }
+  }
+  return x;
+}
+
+int lval_eq(lval* x, lval* y) {
+  // Returns whether x and y are structurally equal
+  int base = lval_frames_num;
+  int eq;
+
+  for (;;) {
+    eq = lval_type(x) == lval_type(y);
+    if (eq) {
+      switch (lval_type(x)) {
+      case LVAL_NUM: eq = lval_get_num(x) == lval_get_num(y); break;
+      case LVAL_ERR: eq = strcmp(x->err, y->err) == 0; break;
+      case LVAL_SYM: eq = x->sym == y->sym; break;
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+	eq = x->count == y->count;
+	if (eq) { lval_frame_push(x, y); }
+	break;
+      }
+    }
+    if (!eq) { break; }
+
+    // move on to the next pair of elements
+    x = NULL;
+    while (lval_frames_num > base) {
+      lframe* f = &lval_frames[lval_frames_num-1];
+      if (f->i < f->v->count) {
+	x = f->v->cell[f->i];
+	y = f->x->cell[f->i];
+	f->i++;
+	break;
+      }
+      lval_frames_num--;
+    }
+    if (!x) { break; }
+  }
+
+  lval_frames_num = base;
+  return eq;
+}
+
 lval* builtin_head(lval* a) {
   // Given a QEXPR within a SEXPR, returns its head
 
   // check error conditions
   LASSERT(a, a->count == 1, "Function 'head' needs exactly one argument!");
 
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, 
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR, 
 	  "Function 'head' passed incorrect type!");
   
   LASSERT(a, a->cell[0]->count > 1, 
@@ -263,7 +925,7 @@ lval* builtin_tail(lval* a) {
   // check error conditions
   LASSERT(a, a->count == 1, "Function 'head' needs exactly one argument!");
 
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, 
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR, 
 	  "Function 'head' passed incorrect type!");
   
   LASSERT(a, a->cell[0]->count > 1, 
@@ -284,27 +946,39 @@ lval* builtin_list(lval* a) {
   
 }
 
-lval* builtin_eval(lval* a) {
-  // Given a QEXPR within an SEXPR, return its evaluation as an SEXPR
+lval* lval_eval_arg(lval* a) {
+  // Checks the arguments of `eval', returning its Q-expression turned
+  // into the S-expression to evaluate (or an error)
 
   // check error conditions
   LASSERT(a, a->count == 1, "Function 'eval' needs exactly one argument!");
 
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, 
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR, 
 	  "Function 'eval' passed incorrect type!");
 
   lval* x = lval_take(a, 0);
   x->type = LVAL_SEXPR;
-  return lval_eval(x);
+  return x;
+}
+
+lval* builtin_eval(lval* a) {
+  // Given a QEXPR within an SEXPR, return its evaluation as an SEXPR.
+  // Both engines run `eval' as a tail call instead (see lval_is_eval),
+  // so this is only reached by calling the builtin directly.
+  return lval_eval(lval_eval_arg(a));
 }
 
 lval* lval_join(lval* x, lval* y) {
   // Combines elements in x and y
 
-  while(y->count) {
-    x = lval_add(x, lval_pop(y, 0));
+  if (y->count) {
+    lval_reserve(x, y->count);
+    memcpy(x->cell + x->count, y->cell, sizeof(lval*) * y->count);
+    x->count += y->count;
   }
 
+  // elements now belong to x, free the shell of y only
+  y->count = 0;
   lval_del(y);
   return x;
 }
@@ -314,13 +988,18 @@ lval* builtin_join(lval* a) {
 
   // precondition
   for (int i = 0; i < a->count; i++) {
-    LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
+    LASSERT(a, lval_type(a->cell[i]) == LVAL_QEXPR,
 	    "Function 'join' passed incorrect type!");
   }
 
   // pop off first child
   lval* x = lval_pop(a, 0);
 
+  // size the result once so each join below is a single memcpy
+  int total = 0;
+  for (int i = 0; i < a->count; i++) { total += a->cell[i]->count; }
+  lval_reserve(x, total);
+
   // pop off the rest
   while (a->count) {
     x = lval_join(x, lval_pop(a, 0));
@@ -330,13 +1009,37 @@ lval* builtin_join(lval* a) {
   return x;
 }
 
-lval* builtin(lval* a, char* func) {
-  if (strcmp("list", func) == 0) { return builtin_list(a); }
-  if (strcmp("head", func) == 0) { return builtin_head(a); }
-  if (strcmp("tail", func) == 0) { return builtin_tail(a); }
-  if (strcmp("join", func) == 0) { return builtin_join(a); }
-  if (strcmp("eval", func) == 0) { return builtin_eval(a); }
-  if (strstr("+-/*", func)) { return builtin_op(a, func); }
+// Native builtins, indexed by the id of the symbol they are bound to.
+// Add new ones with lval_add_builtin; builtin() never needs to change.
+typedef lval* (*lbuiltin)(lval*);
+
+static lbuiltin* lval_builtins = NULL;
+static int lval_builtins_num = 0;
+
+void lval_add_builtin(char* name, lbuiltin func) {
+  // Binds symbol `name' to func, replacing any earlier binding
+  lsym* s = lsym_intern(name);
+
+  if (s->id >= lval_builtins_num) {
+    int n = s->id + 1;
+    lval_builtins = realloc(lval_builtins, sizeof(lbuiltin) * n);
+    memset(lval_builtins + lval_builtins_num, 0,
+	   sizeof(lbuiltin) * (n - lval_builtins_num));
+    lval_builtins_num = n;
+  }
+
+  lval_builtins[s->id] = func;
+}
+
+static int lval_is_eval(lsym* func) {
+  // Returns whether func is bound to `eval', which the engines inline
+  return func->id < lval_builtins_num && lval_builtins[func->id] == builtin_eval;
+}
+
+lval* builtin(lval* a, lsym* func) {
+  if (func->id < lval_builtins_num && lval_builtins[func->id]) {
+    return lval_builtins[func->id](a);
+  }
 
   // non matched
   lval_del(a);
@@ -344,89 +1047,688 @@ lval* builtin(lval* a, char* func) {
 }
 
 lval* lval_eval_sexpr(lval* v) {
-  // Returns the evaluation of an sexpr tree
+  // Returns the evaluation of an sexpr tree. Each S-expression under
+  // evaluation has a frame whose i is the next child to evaluate; an
+  // `eval' in tail position replaces its frame's expression rather than
+  // pushing another frame.
 
-  // evaluate all children (if any)
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(v->cell[i]);
-  }
+  int base = lval_frames_num;
+  lval_frame_push(v, NULL);
+  lval* x = NULL;
 
-  // Return any error found
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
-  }
+  for (;;) {
+    lframe* fr = &lval_frames[lval_frames_num-1];
+    v = fr->v;
 
-  // `()', return as is
-  if (v->count == 0) { return v; }
+    // store the value of the child just evaluated
+    if (x) {
+      v->cell[fr->i++] = x;
+      x = NULL;
+    }
 
-  // single expr, return child
-  if (v->count == 1) { return lval_take(v, 0); }
+    // evaluate children (if any); only S-expressions need a frame
+    while (fr->i < v->count && lval_type(v->cell[fr->i]) != LVAL_SEXPR) {
+      fr->i++;
+    }
+    if (fr->i < v->count) {
+      if ((size_t)(lval_frames_num + 1) * sizeof(lframe) > lval_stack_limit) {
+	lval_del(v->cell[fr->i]);
+	x = lval_err("Stack limit exceeded!");
+      } else {
+	lval_frame_push(v->cell[fr->i], NULL);
+      }
+      continue;
+    }
 
-  // > 1 children, ensure first element is symbol or return error
-  lval* f = lval_pop(v, 0);
-  if (f->type != LVAL_SYM) {
-    lval_del(f);
-    lval_del(v);
-    return lval_err("S-expression does not start with symbol!");
-  }
+    // Return any error found
+    for (int i = 0; i < v->count; i++) {
+      if (lval_type(v->cell[i]) == LVAL_ERR) { x = lval_take(v, i); break; }
+    }
 
-  // call builtin with operator
-  lval* result = builtin(v, f->sym);
-  lval_del(f);
-  return result;
+    if (x) {
+      // error found
+    } else if (v->count == 0) {
+      // `()', return as is
+      x = v;
+    } else if (v->count == 1) {
+      // single expr, return child
+      x = lval_take(v, 0);
+    } else {
+      // > 1 children, ensure first element is symbol or return error
+      lval* f = lval_pop(v, 0);
+      if (lval_type(f) != LVAL_SYM) {
+	lval_del(f);
+	lval_del(v);
+	x = lval_err("S-expression does not start with symbol!");
+      } else if (lval_is_eval(f->sym)) {
+	// evaluate the argument in this frame
+	lval_del(f);
+	x = lval_eval_arg(v);
+	if (lval_type(x) == LVAL_SEXPR) {
+	  lval_frames[lval_frames_num-1].v = x;
+	  lval_frames[lval_frames_num-1].i = 0;
+	  x = NULL;
+	  continue;
+	}
+      } else {
+	// call builtin with operator
+	x = builtin(v, f->sym);
+	lval_del(f);
+      }
+    }
+
+    // frame done, its value goes to the parent
+    if (--lval_frames_num == base) { return x; }
+  }
 }
 
 lval* lval_eval(lval* v) {
   // Returns the evaluation of an expression
   
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(v); }
+  if (lval_type(v) == LVAL_SEXPR) {
+    if (lval_engine == ENGINE_VM) { return lval_vm_eval(v); }
+    return lval_eval_sexpr(v);
+  }
   return v;  // others remain the same
 }
 
-lval* builtin_op(lval* a, char* op) {
+// Bytecode engine
+//
+// lval_compile flattens a read tree into postfix code over a constant
+// pool: leaves are pushed with OP_CONST, and each S-expression becomes
+// OP_CALL when its head is a literal symbol (the common case, resolved
+// without building the symbol lval) or OP_APPLY when the head is only
+// known at run time. lval_vm_run executes the code on a value stack with
+// the same semantics as lval_eval_sexpr. An `eval' call compiles its
+// argument and runs that code in place of the caller, saving the caller
+// on a frame stack unless the call is in tail position.
+
+enum { OP_CONST, OP_NIL, OP_CALL, OP_APPLY, OP_RET };
+
+typedef struct lcode {
+  int count;
+  int slots;
+  int* code;
+
+  int consts_num;
+  int consts_slots;
+  lval** consts;
+} lcode;
+
+static void lcode_emit(lcode* c, int x) {
+  if (c->count == c->slots) {
+    c->slots = c->slots ? c->slots * 2 : 16;
+    c->code = realloc(c->code, sizeof(int) * c->slots);
+  }
+  c->code[c->count++] = x;
+}
+
+static int lcode_const(lcode* c, lval* v) {
+  // Adds v to the constant pool, returning its index
+  if (c->consts_num == c->consts_slots) {
+    c->consts_slots = c->consts_slots ? c->consts_slots * 2 : 16;
+    c->consts = realloc(c->consts, sizeof(lval*) * c->consts_slots);
+  }
+  c->consts[c->consts_num] = v;
+  return c->consts_num++;
+}
+
+static void lval_compile_expr(lcode* c, lval* v) {
+  // Emits code leaving the value of v on the stack. Takes ownership of v.
+  // S-expressions whose children are being compiled wait in a frame,
+  // with x set to the head symbol when the call is an OP_CALL.
+
+  int base = lval_frames_num;
+
+  for (;;) {
+    if (lval_type(v) == LVAL_SEXPR && lval_frames_num > base
+	&& (size_t)(lval_frames_num + 1) * sizeof(lframe) > lval_stack_limit) {
+      // too deep, fails where lval_eval_sexpr would
+      lval_del(v);
+      v = lval_err("Stack limit exceeded!");
+    }
+
+    if (lval_type(v) != LVAL_SEXPR) {
+      lcode_emit(c, OP_CONST);
+      lcode_emit(c, lcode_const(c, v));
+    } else if (v->count == 0) {
+      lcode_emit(c, OP_NIL);
+      lval_del(v);
+    } else if (v->count > 1 && lval_type(v->cell[0]) == LVAL_SYM) {
+      // the head is named by OP_CALL, not pushed
+      lval_frame_push(v, v->cell[0])->i = 1;
+    } else {
+      lval_frame_push(v, NULL);
+    }
+
+    // finish S-expressions with all their children compiled
+    for (;;) {
+      if (lval_frames_num == base) { return; }
+
+      lframe* f = &lval_frames[lval_frames_num-1];
+      if (f->i < f->v->count) {
+	v = f->v->cell[f->i++];
+	break;
+      }
+
+      lval* x = f->v;
+      int n = x->count;
+      if (f->x) {
+	lcode_emit(c, OP_CALL);
+	lcode_emit(c, lcode_const(c, f->x));
+	lcode_emit(c, n - 1);
+      } else if (n > 1) {
+	lcode_emit(c, OP_APPLY);
+	lcode_emit(c, n);
+      }
+      lval_frames_num--;
+
+      // children now belong to the code, free the shell only
+      x->count = 0;
+      lval_del(x);
+    }
+  }
+}
+
+lcode* lval_compile(lval* v) {
+  // Compiles expression v into a new code object. Takes ownership of v.
+  lcode* c = calloc(1, sizeof(lcode));
+  lval_compile_expr(c, v);
+  lcode_emit(c, OP_RET);
+  return c;
+}
+
+void lcode_del(lcode* c) {
+  for (int i = 0; i < c->consts_num; i++) {
+    if (c->consts[i]) { lval_del(c->consts[i]); }
+  }
+  free(c->consts);
+  free(c->code);
+  free(c);
+}
+
+// value stack, shared by nested runs (builtin_eval calls back into the VM)
+static lval** lval_vm_stack = NULL;
+static int lval_vm_sp = 0;
+static int lval_vm_slots = 0;
+
+static int lval_vm_full(void) {
+  // Returns whether one more value would take the stack past the limit
+  return (size_t)(lval_vm_sp + 1) * sizeof(lval*) > lval_stack_limit;
+}
+
+static void lval_vm_push(lval* v) {
+  if (lval_vm_sp == lval_vm_slots) {
+    lval_vm_slots = lval_vm_slots ? lval_vm_slots * 2 : 256;
+    lval_vm_stack = realloc(lval_vm_stack, sizeof(lval*) * lval_vm_slots);
+  }
+  lval_vm_stack[lval_vm_sp++] = v;
+}
+
+// code suspended while an `eval' runs, resumed at pc on its OP_RET
+typedef struct lvm_frame {
+  lcode* c;
+  int pc;
+} lvm_frame;
+
+static lvm_frame* lval_vm_frames = NULL;
+static int lval_vm_frames_num = 0;
+static int lval_vm_frames_slots = 0;
+
+static lval* lval_vm_error(int n) {
+  // If any of the top n values is an error, pops all n and returns the
+  // first error; otherwise returns NULL and leaves the stack alone
+  lval** xs = lval_vm_stack + lval_vm_sp - n;
+  for (int i = 0; i < n; i++) {
+    if (lval_type(xs[i]) == LVAL_ERR) {
+      lval* e = xs[i];
+      for (int j = 0; j < n; j++) {
+	if (j != i) { lval_del(xs[j]); }
+      }
+      lval_vm_sp -= n;
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static lval* lval_vm_args(int n) {
+  // Pops the top n values into a new S-expression
+  lval* a = lval_sexpr();
+  a->count = n;
+  a->cap = n;
+  a->cell = lval_alloc(sizeof(lval*) * n);
+  lval_vm_sp -= n;
+  memcpy(a->cell, lval_vm_stack + lval_vm_sp, sizeof(lval*) * n);
+  return a;
+}
+
+// computed goto dispatch where the compiler has it, a switch otherwise
+#if defined(__GNUC__) && !defined(LVAL_VM_SWITCH)
+#define VM_CASE(op) L_##op:
+#define VM_NEXT goto *vm_labels[code[pc++]]
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT continue
+#endif
+
+lval* lval_vm_run(lcode* c) {
+  // Runs c and returns its result. Takes ownership of c: constants are
+  // moved onto the stack rather than copied, so it can only run once.
+
+  int base = lval_vm_frames_num;
+  int sp = lval_vm_sp;
+  int* code = c->code;
+  int pc = 0;
+  lsym* f;
+  lval* a;
+
+#if defined(__GNUC__) && !defined(LVAL_VM_SWITCH)
+  static void* vm_labels[] = {
+    &&L_OP_CONST, &&L_OP_NIL, &&L_OP_CALL, &&L_OP_APPLY, &&L_OP_RET
+  };
+  VM_NEXT;
+#else
+  for (;;) switch (code[pc++]) {
+#endif
+
+  VM_CASE(OP_CONST) {
+    if (lval_vm_full()) { goto vm_overflow; }
+    int k = code[pc++];
+    lval_vm_push(c->consts[k]);
+    c->consts[k] = NULL;
+    VM_NEXT;
+  }
+
+  VM_CASE(OP_NIL) {
+    if (lval_vm_full()) { goto vm_overflow; }
+    lval_vm_push(lval_sexpr());
+    VM_NEXT;
+  }
+
+  VM_CASE(OP_CALL) {
+    f = c->consts[code[pc]]->sym;
+    int n = code[pc+1];
+    pc += 2;
+
+    lval* e = lval_vm_error(n);
+    if (e) {
+      lval_vm_push(e);
+      VM_NEXT;
+    }
+
+    a = lval_vm_args(n);
+    goto vm_call;
+  }
+
+  VM_CASE(OP_APPLY) {
+    int n = code[pc++];
+
+    lval* e = lval_vm_error(n);
+    if (e) {
+      lval_vm_push(e);
+      VM_NEXT;
+    }
+
+    lval* h = lval_vm_stack[lval_vm_sp - n];
+    if (lval_type(h) != LVAL_SYM) {
+      lval_del(lval_vm_args(n));
+      lval_vm_push(lval_err("S-expression does not start with symbol!"));
+      VM_NEXT;
+    }
+
+    a = lval_vm_args(n - 1);
+    lval_vm_sp--;
+    f = h->sym;
+    lval_del(h);
+    goto vm_call;
+  }
+
+  VM_CASE(OP_RET) {
+    lcode_del(c);
+    if (lval_vm_frames_num == base) {
+      return lval_vm_stack[--lval_vm_sp];
+    }
+
+    // resume the code that called `eval'
+    lvm_frame* fr = &lval_vm_frames[--lval_vm_frames_num];
+    c = fr->c;
+    code = c->code;
+    pc = fr->pc;
+    VM_NEXT;
+  }
+
+  vm_call: {
+    // calls builtin f on arguments a
+    if (!lval_is_eval(f)) {
+      lval_vm_push(builtin(a, f));
+      VM_NEXT;
+    }
+
+    lval* x = lval_eval_arg(a);
+    if (lval_type(x) != LVAL_SEXPR) {
+      lval_vm_push(x);
+      VM_NEXT;
+    }
+
+    if (code[pc] == OP_RET) {
+      // tail call, nothing left to run here
+      lcode_del(c);
+    } else if ((size_t)(lval_vm_frames_num + 1) * sizeof(lvm_frame)
+	       > lval_stack_limit) {
+      lval_del(x);
+      lval_vm_push(lval_err("Stack limit exceeded!"));
+      VM_NEXT;
+    } else {
+      if (lval_vm_frames_num == lval_vm_frames_slots) {
+	lval_vm_frames_slots = lval_vm_frames_slots ? lval_vm_frames_slots * 2 : 64;
+	lval_vm_frames = realloc(lval_vm_frames,
+				 sizeof(lvm_frame) * lval_vm_frames_slots);
+      }
+      lval_vm_frames[lval_vm_frames_num].c = c;
+      lval_vm_frames[lval_vm_frames_num].pc = pc;
+      lval_vm_frames_num++;
+    }
+
+    c = lval_compile(x);
+    code = c->code;
+    pc = 0;
+    VM_NEXT;
+  }
+
+  vm_overflow: {
+    // An error anywhere in the run reaches its result, as no builtin
+    // recovers from one, so give up on the whole run
+    while (lval_vm_sp > sp) { lval_del(lval_vm_stack[--lval_vm_sp]); }
+    lcode_del(c);
+    while (lval_vm_frames_num > base) {
+      lcode_del(lval_vm_frames[--lval_vm_frames_num].c);
+    }
+    return lval_err("Stack limit exceeded!");
+  }
+
+#if !defined(__GNUC__) || defined(LVAL_VM_SWITCH)
+  }
+#endif
+}
+
+#undef VM_CASE
+#undef VM_NEXT
+
+lval* lval_vm_eval(lval* v) {
+  // Evaluates v by compiling it and running the code once
+  return lval_vm_run(lval_compile(v));
+}
+
+lval* lval_eval_checked(lval* v) {
+  // Evaluates v with both engines, reporting any disagreement
+  lval_engine = ENGINE_VM;
+  lval* x = lval_eval(lval_copy(v));
+  lval_engine = ENGINE_TREE;
+  lval* y = lval_eval(v);
+  lval_engine = ENGINE_BOTH;
+
+  if (!lval_eq(x, y)) {
+    printf("engine mismatch! tree-walker gave: ");
+    lval_println(y);
+    printf("bytecode gave: ");
+  }
+  lval_del(y);
+  return x;
+}
+
+lval* builtin_op(lval* a, char op) {
   // Returns result of operator on arguments in `a'
 
   // ensure all arguments are numbers, or return error
   for (int i=0; i < a->count; i++) {
-    if (a->cell[i]->type != LVAL_NUM ) {
+    if (lval_type(a->cell[i]) != LVAL_NUM) {
       lval_del(a);
       return lval_err("Cannot operate on a non-number!");
     }
   }
 
-  // pop off 1st element
-  lval* x = lval_pop(a, 0);
+  // start from the 1st element, working on plain longs until the end
+  long acc = lval_get_num(a->cell[0]);
 
   // check if is unary negation
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
+  if (op == '-' && a->count == 1) {
+    acc = -acc;
   }
 
-  // for each of the remaining args..
-  while(a->count > 0) {
-
-    lval* y = lval_pop(a, 0);  // pop next arg
-
-    if (strcmp(op, "+") == 0) { x->num += y->num; }
-    if (strcmp(op, "-") == 0) { x->num -= y->num; }
-    if (strcmp(op, "*") == 0) { x->num *= y->num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-	lval_del(x); lval_del(y);
-	x = lval_err("Division by zero!"); break;
+  // fold in the remaining args, picking the loop once per call
+  switch (op) {
+  case '+':
+    for (int i = 1; i < a->count; i++) { acc += lval_get_num(a->cell[i]); }
+    break;
+  case '-':
+    for (int i = 1; i < a->count; i++) { acc -= lval_get_num(a->cell[i]); }
+    break;
+  case '*':
+    for (int i = 1; i < a->count; i++) { acc *= lval_get_num(a->cell[i]); }
+    break;
+  case '/':
+    for (int i = 1; i < a->count; i++) {
+      long n = lval_get_num(a->cell[i]);
+      if (n == 0) {
+	lval_del(a);
+	return lval_err("Division by zero!");
       }
-      x->num /= y->num;
+      acc /= n;
     }
-    lval_del(y); // finished with arg
+    break;
   }
 
   lval_del(a);  // finished with arg list
+  return lval_num(acc);
+}
+
+lval* builtin_add(lval* a) { return builtin_op(a, '+'); }
+lval* builtin_sub(lval* a) { return builtin_op(a, '-'); }
+lval* builtin_mul(lval* a) { return builtin_op(a, '*'); }
+lval* builtin_div(lval* a) { return builtin_op(a, '/'); }
+
+void lval_add_builtins(void) {
+  lval_add_builtin("list", builtin_list);
+  lval_add_builtin("head", builtin_head);
+  lval_add_builtin("tail", builtin_tail);
+  lval_add_builtin("join", builtin_join);
+  lval_add_builtin("eval", builtin_eval);
+  lval_add_builtin("+", builtin_add);
+  lval_add_builtin("-", builtin_sub);
+  lval_add_builtin("*", builtin_mul);
+  lval_add_builtin("/", builtin_div);
+}
+
+
+lval* lval_read_line(char* input, mpc_parser_t* lispy) {
+  // Reads a line of input with the selected reader. Syntax errors are
+  // printed here, returning NULL.
+
+  lval* x = NULL;
+
+  if (lval_reader == READER_DIRECT) {
+    if (lval_read_str("<stdin>", input, &x)) { return x; }
+    puts(x->err);
+    lval_del(x);
+    return NULL;
+  }
+
+  mpc_result_t r;
+  if (mpc_parse("<stdin>", input, lispy, &r)) {
+    x = lval_read(r.output);
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+
+  if (lval_reader == READER_BOTH) {
+    // the grammar validates the direct reader
+    lval* y;
+    int ok = lval_read_str("<stdin>", input, &y);
+    if (ok != (x != NULL) || (ok && !lval_eq(x, y))) {
+      printf("reader mismatch! direct reader gave: ");
+      lval_println(y);
+    }
+    lval_del(y);
+  }
+
   return x;
 }
 
 
+// Streaming reader
+//
+// --stream reads a script from piped stdin, or --stream=FILE from a file,
+// with mpca_parse_items, whatever --reader says. The grammar hands over
+// each top-level form's AST once it commits to it, and the form is read,
+// evaluated, printed and freed before the next is parsed. Memory stays
+// bounded by the largest form rather than the script, and output starts
+// with the first form.
+//
+// The grammar here is the REPL's with whitespace as an item of its own
+// rather than trailing each token. A form is then committed once its
+// closing bracket or the byte after its atom is read, without waiting
+// for the next form. The REPL keeps the plain grammar, which is faster
+// and whose errors don't list whitespace.
+
+typedef struct {
+  long forms;
+  long bytes;
+  clock_t eval_time;
+} lstream;
+
+static void lstream_eval(lstream* s, lval* x) {
+  clock_t start = clock();
+  if (lval_engine == ENGINE_BOTH && lval_type(x) == LVAL_SEXPR) {
+    x = lval_eval_checked(x);
+  } else {
+    x = lval_eval(x);
+  }
+  s->eval_time += clock() - start;
+  lval_println(x);
+  lval_reset(x);
+  s->forms++;
+
+  // so each result shows as soon as its form has run, even into a pipe
+  fflush(stdout);
+}
+
+static void lstream_item(mpc_ast_t* t, void* data) {
+  lstream* s = data;
+  if (lval_read_skip(t)) { return; }
+
+  // the form ends with its last leaf
+  mpc_ast_t* last = t;
+  while (last->children_num) { last = last->children[last->children_num-1]; }
+  s->bytes = last->state.pos + strlen(last->contents);
+
+  lstream_eval(s, lval_read(t));
+}
+
+static int lval_stream(char* filename, int lang_flags, int show_stats) {
+  // Runs the script in filename, or piped stdin if it is NULL, returning
+  // whether it parsed
+
+  FILE* f = stdin;
+  if (filename) {
+    f = fopen(filename, "rb");
+    if (f == NULL) {
+      printf("Could not open '%s'\n", filename);
+      return 0;
+    }
+  }
+
+  mpc_parser_t* Number = mpc_new("number");
+  mpc_parser_t* Symbol = mpc_new("symbol");
+  mpc_parser_t* Ws = mpc_new("ws");
+  mpc_parser_t* Sexpr = mpc_new("sexpr");
+  mpc_parser_t* Qexpr = mpc_new("qexpr");
+  mpc_parser_t* Expr = mpc_new("expr");
+  mpc_parser_t* Lispy = mpc_new("lispy");
+
+  mpca_lang(lang_flags | MPCA_LANG_WHITESPACE_SENSITIVE,
+	    "number : /-?[0-9]+/ ;                        \
+                                symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
+                                ws     : /\\s+/ ;                            \
+                                sexpr  : '(' (<expr> | <ws>)* ')' ;          \
+                                qexpr  : '{' (<expr> | <ws>)* '}' ;          \
+                                expr   : <number> | <symbol> | <sexpr> |     \
+                                         <qexpr>;                            \
+                                lispy  : /^/ (<expr> | <ws>)* /$/ ;",
+	    Number, Symbol, Ws, Sexpr, Qexpr, Expr, Lispy);
+
+  lstream s = { 0, 0, 0 };
+  mpc_result_t r;
+  int ok;
+
+  clock_t start = clock();
+  if (filename) {
+    ok = mpca_parse_items_file(filename, f, Lispy, lstream_item, &s, &r);
+    fclose(f);
+  } else {
+    ok = mpca_parse_items_pipe("<stdin>", f, Lispy, lstream_item, &s, &r);
+  }
+  clock_t read_time = clock() - start - s.eval_time;
+
+  if (ok) {
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+  mpc_cleanup(7, Number, Symbol, Ws, Sexpr, Qexpr, Expr, Lispy);
+
+  if (show_stats) {
+    double read_secs = (double)read_time / CLOCKS_PER_SEC;
+    fprintf(stderr, "forms: %ld\n", s.forms);
+    fprintf(stderr, "read: %.1f us, %.1f MB/s\n", read_secs * 1e6,
+	    read_secs > 0 ? s.bytes / read_secs / 1e6 : 0.0);
+    fprintf(stderr, "eval: %.1f us\n", s.eval_time * 1e6 / CLOCKS_PER_SEC);
+  }
+
+  return ok;
+}
+
+
 int main(int arg, char** argv) {
 
+  int show_stats = 0;
+  int stream = 0;
+  char* stream_file = NULL;
+  int lang_flags = MPCA_LANG_DEFAULT;
+  for (int i = 1; i < arg; i++) {
+    if (strcmp(argv[i], "--stats") == 0) { show_stats = 1; }
+    if (strcmp(argv[i], "--stream") == 0) { stream = 1; }
+    if (strncmp(argv[i], "--stream=", 9) == 0) {
+      stream = 1;
+      stream_file = argv[i] + 9;
+    }
+    if (strcmp(argv[i], "--engine=vm") == 0) { lval_engine = ENGINE_VM; }
+    if (strcmp(argv[i], "--engine=tree") == 0) { lval_engine = ENGINE_TREE; }
+    if (strcmp(argv[i], "--engine=both") == 0) { lval_engine = ENGINE_BOTH; }
+    if (strcmp(argv[i], "--reader=direct") == 0) { lval_reader = READER_DIRECT; }
+    if (strcmp(argv[i], "--reader=mpc") == 0) { lval_reader = READER_MPC; }
+    if (strcmp(argv[i], "--reader=both") == 0) { lval_reader = READER_BOTH; }
+    if (strcmp(argv[i], "--packrat") == 0) { lang_flags |= MPCA_LANG_PACKRAT; }
+    if (strncmp(argv[i], "--stack-limit=", 14) == 0) {
+      lval_stack_limit = strtoul(argv[i] + 14, NULL, 10);
+    }
+    if (strncmp(argv[i], "--regex-limit=", 14) == 0) {
+      mpc_re_limit(strtol(argv[i] + 14, NULL, 10));
+    }
+  }
+
+  lval_add_builtins();
+  ltag_init();
+
+  if (stream) {
+    int ok = lval_stream(stream_file, lang_flags, show_stats);
+    mpc_ast_cleanup();
+    return ok ? 0 : 1;
+  }
+
   /* Create parsers */
   mpc_parser_t* Number = mpc_new("number");
   mpc_parser_t* Symbol = mpc_new("symbol");
@@ -436,10 +1738,8 @@ int main(int arg, char** argv) {
   mpc_parser_t* Lispy = mpc_new("lispy");
 
   /* Define them with the following language */
-  mpca_lang(MPCA_LANG_DEFAULT, "number : /-?[0-9]+/ ;                        \
-                                symbol : '+' | '-' | '*' | '/' | \"list\" |  \
-                                         \"head\" | \"tail\" | \"join\" |    \
-                                         \"eval\";                           \
+  mpca_lang(lang_flags, "number : /-?[0-9]+/ ;                        \
+                                symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
                                 sexpr  : '(' <expr>* ')' ;                   \
                                 qexpr  : '{' <expr>* '}' ;                   \
                                 expr   : <number> | <symbol> | <sexpr> |     \
@@ -450,34 +1750,61 @@ int main(int arg, char** argv) {
   puts("Lispy Version 0.0.0.0.1");
   puts("Press Ctrl+c to Exit\n");
 
-  /*Never ending loop*/
+  /*Loop until the end of input*/
   while (1) {
     // output prompt and get input
     char* input = readline("lispy> ");
+    if (input == NULL) { break; }
     
     // Add input to history
     add_history(input);
     
-    // Attempt to parse the input
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      // lval_read - converts into an internal form
+    // Attempt to read the input
+    clock_t start = clock();
+    lval* x = lval_read_line(input, Lispy);
+    clock_t read_time = clock() - start;
+    clock_t eval_time = 0;
+    if (x) {
+      // lval_read_line - converts into an internal form
       // lval_eval - evaluates the internal form
       // lval_print - prints out the internal form
-      lval* x = lval_eval(lval_read(r.output));
+      start = clock();
+      if (lval_engine == ENGINE_BOTH && lval_type(x) == LVAL_SEXPR) {
+	x = lval_eval_checked(x);
+      } else {
+	x = lval_eval(x);
+      }
+      eval_time = clock() - start;
       lval_println(x);  // print expr structure
-      lval_del(x);  // delete expr structure
-    } else {
-      // print error
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+      lval_reset(x);  // delete expr structure
     }
     
+    if (show_stats) {
+      double read_secs = (double)read_time / CLOCKS_PER_SEC;
+      fprintf(stderr, "read: %.1f us, %.1f MB/s\n", read_secs * 1e6,
+	      read_secs > 0 ? strlen(input) / read_secs / 1e6 : 0.0);
+      fprintf(stderr, "eval: %.1f us\n",
+	      eval_time * 1e6 / CLOCKS_PER_SEC);
+      fprintf(stderr, "allocs: %ld, system allocs: %ld\n",
+	      lval_stats.allocs, lval_stats.mallocs);
+      fprintf(stderr, "symbols: %d, lookups: %ld, hits: %ld\n",
+	      lsym_stats.size, lsym_stats.lookups, lsym_stats.hits);
+      if (lval_reader != READER_DIRECT) {
+	mpc_stats_t ms;
+	mpc_stats(&ms);
+	fprintf(stderr, "memo: hits: %ld, misses: %ld, evictions: %ld\n",
+		ms.memo_hits, ms.memo_misses, ms.memo_evictions);
+	fprintf(stderr, "marks: %ld, rewinds: %ld\n", ms.marks, ms.rewinds);
+      }
+      lval_stats.allocs = lval_stats.mallocs = 0;
+    }
+
     // free retrieved input
     free(input);
   }
 
   // undefine and delete parsers
   mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  mpc_ast_cleanup();
   return 0;
 }
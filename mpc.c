@@ -1,5 +1,10 @@
 #include "mpc.h"
 
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define MPC_RUN_SIMD
+#include <immintrin.h>
+#endif
+
 /*
 ** State Type
 */
@@ -30,20 +35,6 @@ static mpc_state_t *mpc_state_copy(mpc_state_t s) {
 ** Error Type
 */
 
-static mpc_err_t *mpc_err_new(const char *filename, mpc_state_t s, const char *expected, char recieved) {
-  mpc_err_t *x = malloc(sizeof(mpc_err_t));
-  x->filename = malloc(strlen(filename) + 1);
-  strcpy(x->filename, filename);
-  x->state = s;
-  x->expected_num = 1;
-  x->expected = malloc(sizeof(char*));
-  x->expected[0] = malloc(strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
-  x->failure = NULL;
-  x->recieved = recieved;
-  return x;
-}
-
 static mpc_err_t *mpc_err_fail(const char *filename, mpc_state_t s, const char *failure) {
   mpc_err_t *x = malloc(sizeof(mpc_err_t));
   x->filename = malloc(strlen(filename) + 1);
@@ -70,38 +61,6 @@ void mpc_err_delete(mpc_err_t *x) {
   free(x);
 }
 
-static int mpc_err_contains_expected(mpc_err_t *x, char *expected) {
-  
-  int i;
-  for (i = 0; i < x->expected_num; i++) {
-    if (strcmp(x->expected[i], expected) == 0) { return 1; }
-  }
-  
-  return 0;
-}
-
-static void mpc_err_add_expected(mpc_err_t *x, char *expected) {
-  
-  x->expected_num++;
-  x->expected = realloc(x->expected, sizeof(char*) * x->expected_num);
-  x->expected[x->expected_num-1] = malloc(strlen(expected) + 1);
-  strcpy(x->expected[x->expected_num-1], expected);
-  
-}
-
-static void mpc_err_clear_expected(mpc_err_t *x, char *expected) {
-  
-  int i;
-  for (i = 0; i < x->expected_num; i++) {
-    free(x->expected[i]);
-  }
-  x->expected_num = 1;
-  x->expected = realloc(x->expected, sizeof(char*) * x->expected_num);
-  x->expected[0] = malloc(strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
-  
-}
-
 void mpc_err_print(mpc_err_t *x) {
   mpc_err_print_to(x, stdout);
 }
@@ -185,93 +144,6 @@ char *mpc_err_string(mpc_err_t *x) {
   return realloc(buffer, strlen(buffer) + 1);
 }
 
-static mpc_err_t *mpc_err_or(mpc_err_t** x, int n) {
-  
-  int i, j;
-  mpc_err_t *e = malloc(sizeof(mpc_err_t));
-  e->state = mpc_state_invalid();
-  e->expected_num = 0;
-  e->expected = NULL;
-  e->failure = NULL;
-  e->filename = malloc(strlen(x[0]->filename)+1);
-  strcpy(e->filename, x[0]->filename);
-  
-  for (i = 0; i < n; i++) {
-    if (x[i]->state.pos > e->state.pos) { e->state = x[i]->state; }
-  }
-  
-  for (i = 0; i < n; i++) {
-    
-    if (x[i]->state.pos < e->state.pos) { continue; }
-    
-    if (x[i]->failure) {
-      e->failure = malloc(strlen(x[i]->failure)+1);
-      strcpy(e->failure, x[i]->failure);
-      break;
-    }
-    
-    e->recieved = x[i]->recieved;
-    
-    for (j = 0; j < x[i]->expected_num; j++) {
-      if (!mpc_err_contains_expected(e, x[i]->expected[j])) { mpc_err_add_expected(e, x[i]->expected[j]); }
-    }
-  }
-  
-  for (i = 0; i < n; i++) {
-    mpc_err_delete(x[i]);
-  }
-  
-  return e;
-}
-
-static mpc_err_t *mpc_err_repeat(mpc_err_t *x, const char *prefix) {
-
-  int i;
-  char *expect = malloc(strlen(prefix) + 1);
-  strcpy(expect, prefix);
-  
-  if (x->expected_num == 1) {
-    expect = realloc(expect, strlen(expect) + strlen(x->expected[0]) + 1);
-    strcat(expect, x->expected[0]);
-  }
-  
-  if (x->expected_num > 1) {
-  
-    for (i = 0; i < x->expected_num-2; i++) {
-      expect = realloc(expect, strlen(expect) + strlen(x->expected[i]) + strlen(", ") + 1);
-      strcat(expect, x->expected[i]);
-      strcat(expect, ", ");
-    }
-    
-    expect = realloc(expect, strlen(expect) + strlen(x->expected[x->expected_num-2]) + strlen(" or ") + 1);
-    strcat(expect, x->expected[x->expected_num-2]);
-    strcat(expect, " or ");
-    expect = realloc(expect, strlen(expect) + strlen(x->expected[x->expected_num-1]) + 1);
-    strcat(expect, x->expected[x->expected_num-1]);
-
-  }
-  
-  mpc_err_clear_expected(x, expect);
-  free(expect);
-  
-  return x;
-
-}
-
-static mpc_err_t *mpc_err_many1(mpc_err_t *x) {
-  return mpc_err_repeat(x, "one or more of ");
-}
-
-static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
-  mpc_err_t *y;
-  int digits = n/10 + 1;
-  char *prefix = malloc(digits + strlen(" of ") + 1);
-  sprintf(prefix, "%i of ", n);
-  y = mpc_err_repeat(x, prefix);
-  free(prefix);
-  return y;
-}
-
 /*
 ** Input Type
 */
@@ -280,26 +152,27 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** In mpc the input type has three modes of 
 ** operation: String, File and Pipe.
 **
-** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
-** The cursor can jump around at will making 
-** backtracking easy.
+** String is easy. The caller's buffer is
+** borrowed (not copied) along with its length
+** and scanned through. The cursor can jump
+** around at will making backtracking easy.
 **
 ** The second is a File which is also somewhat
-** easy. The contents are never loaded into 
-** memory but backtracking can still be achieved
-** by seeking in the file at different positions.
+** easy. The contents are read a large block at a
+** time into a window which slides along the file,
+** keeping everything from the earliest mark so
+** backtracking just moves the cursor back inside
+** it. Once no mark needs them earlier blocks are
+** dropped the next time the window is refilled.
 **
-** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and 
-** only support a single character lookahead at 
-** any point, when the input is marked for a 
-** potential backtracking we start buffering any 
-** input.
-**
-** This means that if we are requested to seek
-** back we can simply start reading from the
-** buffer instead of the input.
+** The final mode is Pipe. As pipes cannot be
+** seeked they share the window with files but
+** are read into it only a character at a time,
+** so the parse never takes more from the pipe
+** than it has looked at. Backtracking works the
+** same way as for files, and once the outermost
+** mark is released whatever the window grew to
+** is handed back.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -307,6 +180,11 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 **
 */
 
+typedef struct {
+  mpc_state_t state;
+  char last;
+} mpc_mark_t;
+
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
@@ -319,20 +197,42 @@ typedef struct {
   char *filename;  
   mpc_state_t state;
   
-  char *string;
+  const char *string;
+  long length;
   char *buffer;
+  long buffer_pos;
+  long buffer_len;
+  long buffer_slots;
   FILE *file;
   
   int backtrack;
   int marks_num;
-  mpc_state_t* marks;
-  char* lasts;
+  int marks_slots;
+  mpc_mark_t *marks;
   
   char last;
   
+  int memo_slots;
+  struct mpc_memo_t *memo;
+  
+  struct mpc_fault_t *faults;
+  char **strings;
+  int strings_num;
+  int strings_slots;
+  char *scratch;
+  long scratch_slots;
+  
+  mpca_item_t item;
+  void *item_data;
+  
+  mpc_stats_t stats;
+  
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+static void mpc_input_memo_delete(mpc_input_t *i);
+static void mpc_input_faults_delete(mpc_input_t *i);
+
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string, long length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
@@ -342,15 +242,31 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = string;
+  i->length = length;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = NULL;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
-  i->lasts = NULL;
+  
+  i->memo_slots = 0;
+  i->memo = NULL;
+  
+  i->faults = NULL;
+  i->strings = NULL;
+  i->strings_num = 0;
+  i->strings_slots = 0;
+  i->scratch = NULL;
+  i->scratch_slots = 0;
+  i->item = NULL;
+  i->item_data = NULL;
+  memset(&i->stats, 0, sizeof(mpc_stats_t));
 
   i->last = '\0';
   
@@ -368,13 +284,30 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = pipe;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
-  i->lasts = NULL;
+  
+  i->memo_slots = 0;
+  i->memo = NULL;
+  
+  i->faults = NULL;
+  i->strings = NULL;
+  i->strings_num = 0;
+  i->strings_slots = 0;
+  i->scratch = NULL;
+  i->scratch_slots = 0;
+  i->item = NULL;
+  i->item_data = NULL;
+  memset(&i->stats, 0, sizeof(mpc_stats_t));
   
   i->last = '\0';
   
@@ -392,13 +325,30 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = file;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
-  i->lasts = NULL;
+  
+  i->memo_slots = 0;
+  i->memo = NULL;
+  
+  i->faults = NULL;
+  i->strings = NULL;
+  i->strings_num = 0;
+  i->strings_slots = 0;
+  i->scratch = NULL;
+  i->scratch_slots = 0;
+  i->item = NULL;
+  i->item_data = NULL;
+  memset(&i->stats, 0, sizeof(mpc_stats_t));
   
   i->last = '\0';
   
@@ -409,14 +359,102 @@ static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  /* Give back what was read ahead of the end of the parse, where the file allows it */
+  if (i->type == MPC_INPUT_FILE && i->buffer_pos + i->buffer_len > i->state.pos) {
+    fseek(i->file, i->state.pos - (i->buffer_pos + i->buffer_len), SEEK_CUR);
+  }
+  
+  /* A pipe can only be given back the one character */
+  if (i->type == MPC_INPUT_PIPE && i->buffer_pos + i->buffer_len > i->state.pos) {
+    ungetc((unsigned char)i->buffer[i->state.pos - i->buffer_pos], i->file);
+  }
+  
+  free(i->buffer);
   
   free(i->marks);
-  free(i->lasts);
+  mpc_input_memo_delete(i);
+  mpc_input_faults_delete(i);
   free(i);
 }
 
+enum { MPC_INPUT_BLOCK = 1 << 16 };
+
+static int mpc_input_fill(mpc_input_t *i) {
+  
+  /*
+  ** Reads more of a file or pipe onto the end of the
+  ** window, a block at a time for files and a single
+  ** character at a time for pipes. What no mark can go
+  ** back to is dropped first, but only when that moves
+  ** no more than it frees, so sliding stays linear.
+  */
+  
+  long keep = i->marks_num > 0 && i->marks[0].state.pos < i->state.pos ? i->marks[0].state.pos : i->state.pos;
+  long drop = keep - i->buffer_pos;
+  long want = i->type == MPC_INPUT_PIPE ? 1 : MPC_INPUT_BLOCK;
+  size_t n;
+  int c;
+  
+  if (drop > i->buffer_len) { drop = i->buffer_len; }  
+  if (drop > 0 && drop >= i->buffer_len - drop) {
+    memmove(i->buffer, i->buffer + drop, i->buffer_len - drop);
+    i->buffer_pos += drop;
+    i->buffer_len -= drop;
+  }
+  
+  if (i->buffer_len + want > i->buffer_slots) {
+    i->buffer_slots = i->buffer_slots * 2 > i->buffer_len + want
+      ? i->buffer_slots * 2 : i->buffer_len + want;
+    i->buffer = realloc(i->buffer, i->buffer_slots);
+  }
+  
+  if (i->type == MPC_INPUT_PIPE) {
+    if ((c = getc(i->file)) == EOF) { return 0; }
+    i->buffer[i->buffer_len++] = c;
+    return 1;
+  }
+  
+  n = fread(i->buffer + i->buffer_len, 1, MPC_INPUT_BLOCK, i->file);
+  i->buffer_len += n;
+  return n > 0;
+}
+
+static int mpc_input_buffered(mpc_input_t *i) {
+  /* If the character at the cursor is in the window, reading up to it if need be */
+  while (i->state.pos >= i->buffer_pos + i->buffer_len) {
+    if (!mpc_input_fill(i)) { return 0; }
+  }
+  return 1;
+}
+
+static const char *mpc_input_window(mpc_input_t *i, long *n) {
+  
+  /* The characters from the cursor on which are already in memory */
+  
+  if (i->type == MPC_INPUT_STRING) {
+    *n = i->length - i->state.pos;
+    return i->string + i->state.pos;
+  }
+  
+  *n = mpc_input_buffered(i) ? i->buffer_pos + i->buffer_len - i->state.pos : 0;
+  return i->buffer + (i->state.pos - i->buffer_pos);
+}
+
+static void mpc_input_release(mpc_input_t *i) {
+  
+  /* Shrinks a pipe's window back down once nothing can go back into it */
+  
+  long ahead = i->buffer_pos + i->buffer_len - i->state.pos;
+  
+  if (i->buffer_slots <= MPC_INPUT_BLOCK) { return; }
+  
+  memmove(i->buffer, i->buffer + (i->state.pos - i->buffer_pos), ahead);
+  i->buffer_pos = i->state.pos;
+  i->buffer_len = ahead;
+  i->buffer_slots = ahead > MPC_INPUT_BLOCK ? ahead : MPC_INPUT_BLOCK;
+  i->buffer = realloc(i->buffer, i->buffer_slots);
+}
+
 static void mpc_input_backtrack_disable(mpc_input_t *i) { i->backtrack--; }
 static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 
@@ -424,16 +462,17 @@ static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
-  i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
-  i->marks[i->marks_num-1] = i->state;
-  i->lasts[i->marks_num-1] = i->last;
-  
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+  /* The stack only ever grows, so after the first few combinators marking is just a store */
+  if (i->marks_num == i->marks_slots) {
+    i->marks_slots = i->marks_slots ? i->marks_slots * 2 : 32;
+    i->marks = realloc(i->marks, sizeof(mpc_mark_t) * i->marks_slots);
   }
   
+  i->marks[i->marks_num].state = i->state;
+  i->marks[i->marks_num].last = i->last;
+  i->marks_num++;
+  i->stats.marks++;
+  
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
@@ -441,12 +480,9 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
+    mpc_input_release(i);
   }
   
 }
@@ -455,123 +491,54 @@ static void mpc_input_rewind(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
-  i->state = i->marks[i->marks_num-1];
-  i->last  = i->lasts[i->marks_num-1];
-  
-  if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
-  }
+  i->state = i->marks[i->marks_num-1].state;
+  i->last  = i->marks[i->marks_num-1].last;
+  i->stats.rewinds++;
   
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
-}
-
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+static void mpc_input_commit(mpc_input_t *i) {
+  
+  /*
+  ** Once nothing can backtrack over what has been read, every mark
+  ** is moved up to the cursor. Any rewind left is followed by a failure
+  ** of the whole parse, which reports its own position, and the
+  ** window no longer has to keep what came before.
+  */
+  
+  int j;
+  
+  for (j = 0; j < i->marks_num; j++) {
+    i->marks[j].state = i->state;
+    i->marks[j].last = i->last;
+  }
+  
+  if (i->type == MPC_INPUT_PIPE) { mpc_input_release(i); }
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
-  if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
-  return 0;
+  if (i->type == MPC_INPUT_STRING) { return i->state.pos >= i->length; }
+  return !mpc_input_buffered(i);
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
-  
-  char c = '\0';
-  
-  switch (i->type) {
-    
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-    
-      if (!i->buffer) { c = getc(i->file); return c; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
-    
-    default: return c;
-  }
+  if (i->type == MPC_INPUT_STRING) { return i->state.pos < i->length ? i->string[i->state.pos] : '\0'; }
+  return mpc_input_buffered(i) ? i->buffer[i->state.pos - i->buffer_pos] : '\0';
 }
 
 static char mpc_input_peekc(mpc_input_t *i) {
-  
-  char c = '\0';
-  
-  switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: 
-      
-      c = fgetc(i->file);
-      if (feof(i->file)) { return '\0'; }
-      
-      fseek(i->file, -1, SEEK_CUR);
-      return c;
-    
-    case MPC_INPUT_PIPE:
-      
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-    
-    default: return c;
-  }
-  
+  return mpc_input_getc(i);
 }
 
 static int mpc_input_failure(mpc_input_t *i, char c) {
-
-  switch (i->type) {
-    case MPC_INPUT_STRING: { break; }
-    case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-      
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file); 
-      }
-    }
-    default: { break; }
-  }
+  /* Nothing to give back, as a character is only consumed by moving past it */
+  (void)i; (void)c;
   return 0;
 }
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
-  if (i->type == MPC_INPUT_PIPE &&
-      i->buffer &&
-      !mpc_input_buffer_in_range(i)) {
-    
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-  
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -608,16 +575,14 @@ static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+static int mpc_class_has(const unsigned char *set, char c) {
+  return (set[(unsigned char)c / 8] >> ((unsigned char)c % 8)) & 1;
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_class(mpc_input_t *i, const unsigned char *set, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return mpc_class_has(set, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -628,14 +593,11 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
 
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   
-  char *co = NULL;
   const char *x = c;
 
   mpc_input_mark(i);
   while (*x) {
-    if (mpc_input_char(i, *x, &co)) {
-      free(co);
-    } else {
+    if (!mpc_input_char(i, *x, NULL)) {
       mpc_input_rewind(i);
       return 0;
     }
@@ -652,66 +614,352 @@ static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char)) {
   return f(i->last, mpc_input_peekc(i));
 }
 
+static char *mpc_input_span(mpc_input_t *i, int(*f)(mpc_input_t*,void*), void *p, long *n) {
+  
+  /* Matches `f` as many times as it will go and returns the `n` matched characters as one string */
+  
+  long start = i->state.pos;
+  long len = 0, slots = 0;
+  char *s = NULL;
+  
+  while (f(i, p)) {
+    if (i->type != MPC_INPUT_STRING) {
+      if (len + 1 >= slots) {
+        slots = slots ? slots * 2 : 16;
+        s = realloc(s, slots);
+      }
+      s[len] = i->last;
+    }
+    len++;
+  }
+  
+  if (i->type == MPC_INPUT_STRING) {
+    s = malloc(len + 1);
+    memcpy(s, i->string + start, len);
+  }
+  
+  if (s == NULL) { s = malloc(1); }
+  s[len] = '\0';
+  *n = len;
+  return s;
+}
+
 /*
-** Parser Type
+** Faults
+**
+** Most errors made during a parse are thrown away,
+** either merged under one that got further or dropped
+** when a later alternative succeeds. So inside the
+** parse an error is a fault: a position, the character
+** found there, and a list of what was expected, whose
+** strings are borrowed from the parsers rather than
+** copied. Faults are recycled through a free list on
+** the input. Strings made up by repeats are interned
+** on the input so they can be borrowed just the same.
+**
+** Only the one fault a failed parse ends with is
+** turned into an `mpc_err_t`.
 */
 
-enum {
-  MPC_TYPE_UNDEFINED = 0,
-  MPC_TYPE_PASS      = 1,
-  MPC_TYPE_FAIL      = 2,
-  MPC_TYPE_LIFT      = 3,
-  MPC_TYPE_LIFT_VAL  = 4,
-  MPC_TYPE_EXPECT    = 5,
-  MPC_TYPE_ANCHOR    = 6,
-  MPC_TYPE_STATE     = 7,
+typedef struct mpc_fault_t {
+  mpc_state_t state;
+  char recieved;
+  const char *failure;
+  int expected_num;
+  int expected_slots;
+  const char **expected;
+  struct mpc_fault_t *next;
+} mpc_fault_t;
+
+static mpc_fault_t *mpc_fault_alloc(mpc_input_t *i, mpc_state_t s) {
   
-  MPC_TYPE_ANY       = 8,
-  MPC_TYPE_SINGLE    = 9,
-  MPC_TYPE_ONEOF     = 10,
-  MPC_TYPE_NONEOF    = 11,
-  MPC_TYPE_RANGE     = 12,
-  MPC_TYPE_SATISFY   = 13,
-  MPC_TYPE_STRING    = 14,
+  mpc_fault_t *x = i->faults;
   
-  MPC_TYPE_APPLY     = 15,
-  MPC_TYPE_APPLY_TO  = 16,
-  MPC_TYPE_PREDICT   = 17,
-  MPC_TYPE_NOT       = 18,
-  MPC_TYPE_MAYBE     = 19,
-  MPC_TYPE_MANY      = 20,
-  MPC_TYPE_MANY1     = 21,
-  MPC_TYPE_COUNT     = 22,
+  if (x) {
+    i->faults = x->next;
+  } else {
+    x = malloc(sizeof(mpc_fault_t));
+    x->expected_slots = 0;
+    x->expected = NULL;
+  }
   
-  MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
-};
+  x->state = s;
+  x->recieved = ' ';
+  x->failure = NULL;
+  x->expected_num = 0;
+  return x;
+}
 
-typedef struct { char *m; } mpc_pdata_fail_t;
-typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
-typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
-typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
-typedef struct { char x; } mpc_pdata_single_t;
-typedef struct { char x; char y; } mpc_pdata_range_t;
-typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
-typedef struct { char *x; } mpc_pdata_string_t;
-typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
-typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
-typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
-typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
-typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
-typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+static void mpc_fault_delete(mpc_input_t *i, mpc_fault_t *x) {
+  x->next = i->faults;
+  i->faults = x;
+}
 
-typedef union {
-  mpc_pdata_fail_t fail;
-  mpc_pdata_lift_t lift;
-  mpc_pdata_expect_t expect;
-  mpc_pdata_anchor_t anchor;
-  mpc_pdata_single_t single;
-  mpc_pdata_range_t range;
+static void mpc_fault_add_expected(mpc_fault_t *x, const char *expected) {
+  if (x->expected_num == x->expected_slots) {
+    x->expected_slots = x->expected_slots ? x->expected_slots * 2 : 4;
+    x->expected = realloc(x->expected, sizeof(char*) * x->expected_slots);
+  }
+  x->expected[x->expected_num++] = expected;
+}
+
+static int mpc_fault_contains_expected(mpc_fault_t *x, const char *expected) {
+  int j;
+  for (j = 0; j < x->expected_num; j++) {
+    if (x->expected[j] == expected || strcmp(x->expected[j], expected) == 0) { return 1; }
+  }
+  return 0;
+}
+
+static mpc_fault_t *mpc_fault_new(mpc_input_t *i, mpc_state_t s, const char *expected, char recieved) {
+  mpc_fault_t *x = mpc_fault_alloc(i, s);
+  mpc_fault_add_expected(x, expected);
+  x->recieved = recieved;
+  return x;
+}
+
+static mpc_fault_t *mpc_fault_fail(mpc_input_t *i, mpc_state_t s, const char *failure) {
+  mpc_fault_t *x = mpc_fault_alloc(i, s);
+  x->failure = failure;
+  return x;
+}
+
+static mpc_fault_t *mpc_fault_copy(mpc_input_t *i, mpc_fault_t *x) {
+  int j;
+  mpc_fault_t *y = mpc_fault_alloc(i, x->state);
+  for (j = 0; j < x->expected_num; j++) {
+    mpc_fault_add_expected(y, x->expected[j]);
+  }
+  y->failure = x->failure;
+  y->recieved = x->recieved;
+  return y;
+}
+
+static mpc_fault_t *mpc_fault_or(mpc_input_t *i, mpc_fault_t *x, mpc_fault_t *y) {
+  
+  /*
+  ** Keeps whichever got further. At the same place the
+  ** expected lists are joined in order, unless one is a
+  ** failure message, which then stands for the rest.
+  ** Folding this over a list merges the whole list.
+  */
+  
+  int j;
+  
+  if (y->state.pos > x->state.pos) { mpc_fault_delete(i, x); return y; }
+  if (y->state.pos < x->state.pos || x->failure) { mpc_fault_delete(i, y); return x; }
+  
+  if (y->failure) {
+    x->failure = y->failure;
+  } else {
+    x->recieved = y->recieved;
+    for (j = 0; j < y->expected_num; j++) {
+      if (!mpc_fault_contains_expected(x, y->expected[j])) { mpc_fault_add_expected(x, y->expected[j]); }
+    }
+  }
+  
+  mpc_fault_delete(i, y);
+  return x;
+}
+
+static unsigned long mpc_fault_hash(const char *s) {
+  unsigned long h = 5381;
+  while (*s) { h = h * 33 + (unsigned char)*s++; }
+  return h;
+}
+
+static const char *mpc_fault_intern(mpc_input_t *i, const char *s) {
+  
+  int j, n;
+  char **strings;
+  unsigned long h = mpc_fault_hash(s);
+  
+  if (i->strings_num * 4 >= i->strings_slots * 3) {
+    n = i->strings_slots ? i->strings_slots * 2 : 16;
+    strings = calloc(n, sizeof(char*));
+    for (j = 0; j < i->strings_slots; j++) {
+      if (i->strings[j] == NULL) { continue; }
+      h = mpc_fault_hash(i->strings[j]) & (n-1);
+      while (strings[h]) { h = (h + 1) & (n-1); }
+      strings[h] = i->strings[j];
+    }
+    free(i->strings);
+    i->strings = strings;
+    i->strings_slots = n;
+    h = mpc_fault_hash(s);
+  }
+  
+  h &= i->strings_slots - 1;
+  while (i->strings[h]) {
+    if (strcmp(i->strings[h], s) == 0) { return i->strings[h]; }
+    h = (h + 1) & (i->strings_slots - 1);
+  }
+  
+  i->strings[h] = malloc(strlen(s) + 1);
+  strcpy(i->strings[h], s);
+  i->strings_num++;
+  return i->strings[h];
+}
+
+static mpc_fault_t *mpc_fault_repeat(mpc_input_t *i, mpc_fault_t *x, const char *prefix) {
+  
+  /* Rolls the expected list up into one string behind `prefix` */
+  
+  int j;
+  long n = strlen(prefix) + 1;
+  char *expect;
+  
+  for (j = 0; j < x->expected_num; j++) {
+    n += strlen(x->expected[j]) + strlen(", ");
+  }
+  
+  if (n > i->scratch_slots) {
+    i->scratch_slots = n;
+    i->scratch = realloc(i->scratch, n);
+  }
+  
+  expect = i->scratch;
+  strcpy(expect, prefix);
+  
+  if (x->expected_num == 1) {
+    strcat(expect, x->expected[0]);
+  }
+  
+  if (x->expected_num > 1) {
+    for (j = 0; j < x->expected_num-2; j++) {
+      strcat(expect, x->expected[j]);
+      strcat(expect, ", ");
+    }
+    strcat(expect, x->expected[x->expected_num-2]);
+    strcat(expect, " or ");
+    strcat(expect, x->expected[x->expected_num-1]);
+  }
+  
+  x->expected_num = 0;
+  mpc_fault_add_expected(x, mpc_fault_intern(i, expect));
+  return x;
+}
+
+static mpc_fault_t *mpc_fault_many1(mpc_input_t *i, mpc_fault_t *x) {
+  return mpc_fault_repeat(i, x, "one or more of ");
+}
+
+static mpc_fault_t *mpc_fault_count(mpc_input_t *i, mpc_fault_t *x, int n) {
+  char prefix[32];
+  sprintf(prefix, "%i of ", n);
+  return mpc_fault_repeat(i, x, prefix);
+}
+
+static mpc_err_t *mpc_fault_export(mpc_input_t *i, mpc_fault_t *x) {
+  
+  /* Makes the `mpc_err_t` for a failed parse, with its own copies of everything */
+  
+  int j;
+  mpc_err_t *e = malloc(sizeof(mpc_err_t));
+  
+  e->filename = malloc(strlen(i->filename) + 1);
+  strcpy(e->filename, i->filename);
+  e->state = x->state;
+  e->expected_num = x->expected_num;
+  e->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    e->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(e->expected[j], x->expected[j]);
+  }
+  e->failure = NULL;
+  if (x->failure) {
+    e->failure = malloc(strlen(x->failure) + 1);
+    strcpy(e->failure, x->failure);
+  }
+  e->recieved = x->recieved;
+  return e;
+}
+
+static void mpc_input_faults_delete(mpc_input_t *i) {
+  
+  int j;
+  mpc_fault_t *x;
+  
+  while ((x = i->faults)) {
+    i->faults = x->next;
+    free(x->expected);
+    free(x);
+  }
+  
+  for (j = 0; j < i->strings_slots; j++) {
+    free(i->strings[j]);
+  }
+  free(i->strings);
+  free(i->scratch);
+}
+
+/*
+** Parser Type
+*/
+
+enum {
+  MPC_TYPE_UNDEFINED = 0,
+  MPC_TYPE_PASS      = 1,
+  MPC_TYPE_FAIL      = 2,
+  MPC_TYPE_LIFT      = 3,
+  MPC_TYPE_LIFT_VAL  = 4,
+  MPC_TYPE_EXPECT    = 5,
+  MPC_TYPE_ANCHOR    = 6,
+  MPC_TYPE_STATE     = 7,
+  
+  MPC_TYPE_ANY       = 8,
+  MPC_TYPE_SINGLE    = 9,
+  MPC_TYPE_ONEOF     = 10,
+  MPC_TYPE_NONEOF    = 11,
+  MPC_TYPE_RANGE     = 12,
+  MPC_TYPE_SATISFY   = 13,
+  MPC_TYPE_STRING    = 14,
+  
+  MPC_TYPE_APPLY     = 15,
+  MPC_TYPE_APPLY_TO  = 16,
+  MPC_TYPE_PREDICT   = 17,
+  MPC_TYPE_NOT       = 18,
+  MPC_TYPE_MAYBE     = 19,
+  MPC_TYPE_MANY      = 20,
+  MPC_TYPE_MANY1     = 21,
+  MPC_TYPE_COUNT     = 22,
+  
+  MPC_TYPE_OR        = 23,
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_MEMO      = 25,
+  MPC_TYPE_DFA       = 26
+};
+
+typedef struct { char *m; } mpc_pdata_fail_t;
+typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
+typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
+typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
+typedef struct { char x; } mpc_pdata_single_t;
+typedef struct { char x; char y; } mpc_pdata_range_t;
+typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
+typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; unsigned char *set; int n; unsigned char lo[8]; unsigned char hi[8]; } mpc_pdata_class_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
+typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
+typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
+typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
+typedef struct { int n; int defines; mpc_parser_t **xs; short *dispatch; unsigned char *first; } mpc_pdata_or_t;
+typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t copy; mpc_dtor_t dx; } mpc_pdata_memo_t;
+typedef struct { mpc_parser_t *x; int n; int *table; char *final; mpc_parser_t **atoms; mpc_pdata_class_t *loops; } mpc_pdata_dfa_t;
+
+typedef union {
+  mpc_pdata_fail_t fail;
+  mpc_pdata_lift_t lift;
+  mpc_pdata_expect_t expect;
+  mpc_pdata_anchor_t anchor;
+  mpc_pdata_single_t single;
+  mpc_pdata_range_t range;
   mpc_pdata_satisfy_t satisfy;
   mpc_pdata_string_t string;
+  mpc_pdata_class_t class;
   mpc_pdata_apply_t apply;
   mpc_pdata_apply_to_t apply_to;
   mpc_pdata_predict_t predict;
@@ -719,6 +967,8 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_memo_t memo;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -728,12 +978,297 @@ struct mpc_parser_t {
   mpc_pdata_t data;
 };
 
+/*
+** Spans
+**
+** Regexes, tokens and whitespace are mostly `many`
+** or `many1` of a single character parser, folded
+** with `mpcf_strfold`. Run through the stack that
+** costs a malloc'd string per character plus the fold
+** to join them, so instead such repeats match their
+** characters in a loop and copy the span they cover
+** out of the input once at the end.
+*/
+
+static mpc_parser_t *mpc_span_char(mpc_parser_t *p) {
+  while (p->type == MPC_TYPE_EXPECT) { p = p->data.expect.x; }
+  if (p->type >= MPC_TYPE_ANY && p->type <= MPC_TYPE_SATISFY) { return p; }
+  return NULL;
+}
+
+static int mpc_span_match(mpc_input_t *i, void *q) {
+  mpc_parser_t *p = q;
+  switch (p->type) {
+    case MPC_TYPE_ANY:     return mpc_input_any(i, NULL);
+    case MPC_TYPE_SINGLE:  return mpc_input_char(i, p->data.single.x, NULL);
+    case MPC_TYPE_RANGE:   return mpc_input_range(i, p->data.range.x, p->data.range.y, NULL);
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:  return mpc_input_class(i, p->data.class.set, NULL);
+    case MPC_TYPE_SATISFY: return mpc_input_satisfy(i, p->data.satisfy.f, NULL);
+    default: return 0;
+  }
+}
+
+static int mpc_span_accepts(mpc_parser_t *p, char c) {
+  /* If a single character parser would accept `c`, without touching the input */
+  switch (p->type) {
+    case MPC_TYPE_ANY:     return 1;
+    case MPC_TYPE_SINGLE:  return c == p->data.single.x;
+    case MPC_TYPE_RANGE:   return c >= p->data.range.x && c <= p->data.range.y;
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:  return mpc_class_has(p->data.class.set, c);
+    case MPC_TYPE_SATISFY: return p->data.satisfy.f(c);
+    default: return 0;
+  }
+}
+
+static mpc_fault_t *mpc_span_err(mpc_input_t *i, mpc_parser_t *p) {
+  /* The error the failed repetition ending the span would have given */
+  if (p->type == MPC_TYPE_EXPECT) {
+    return mpc_fault_new(i, i->state, p->data.expect.m, mpc_input_peekc(i));
+  }
+  return mpc_fault_fail(i, i->state, "Incorrect Input");
+}
+
+/*
+** Runs
+**
+** Over string input a span of one character class
+** is found by scanning the string directly rather
+** than matching it a character at a time. Classes
+** that are a few ranges of bytes are tested sixteen
+** or thirty-two bytes at a time with SSE2 or AVX2,
+** picked when first used, and others byte by byte
+** against their bitmap. The position, row and column
+** are then moved past the whole run in one go. A
+** compiled regex does the same whenever it is on a
+** step that repeats a class.
+*/
+
+enum { MPC_RUN_RANGES = 8 };
+
+typedef struct {
+  const unsigned char *set;
+  int n;
+  const unsigned char *lo;
+  const unsigned char *hi;
+} mpc_run_t;
+
+static int mpc_run_has(const mpc_run_t *r, unsigned char c) {
+  int j;
+  if (r->set) { return mpc_class_has(r->set, (char)c); }
+  for (j = 0; j < r->n; j++) {
+    if (c >= r->lo[j] && c <= r->hi[j]) { return 1; }
+  }
+  return 0;
+}
+
+static long mpc_run_scalar(const mpc_run_t *r, const char *s, long n) {
+  long k = 0;
+  while (k < n && mpc_run_has(r, (unsigned char)s[k])) { k++; }
+  return k;
+}
+
+#ifdef MPC_RUN_SIMD
+
+/*
+** A byte `x` is in range `lo..hi` when `x - lo`
+** is at most `hi - lo` unsigned, which is when
+** their unsigned maximum is `hi - lo` itself.
+*/
+
+static long mpc_run_sse2(const mpc_run_t *r, const char *s, long n) {
+  
+  __m128i lo[MPC_RUN_RANGES], w[MPC_RUN_RANGES], x, d, in;
+  long k = 0;
+  int j, m;
+  
+  for (j = 0; j < r->n; j++) {
+    lo[j] = _mm_set1_epi8((char)r->lo[j]);
+    w[j]  = _mm_set1_epi8((char)(r->hi[j] - r->lo[j]));
+  }
+  
+  for (; k + 16 <= n; k += 16) {
+    x  = _mm_loadu_si128((const __m128i*)(s + k));
+    in = _mm_setzero_si128();
+    for (j = 0; j < r->n; j++) {
+      d  = _mm_sub_epi8(x, lo[j]);
+      in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_max_epu8(d, w[j]), w[j]));
+    }
+    m = _mm_movemask_epi8(in);
+    if (m != 0xFFFF) { return k + __builtin_ctz(~m); }
+  }
+  
+  return k + mpc_run_scalar(r, s + k, n - k);
+}
+
+__attribute__((target("avx2")))
+static long mpc_run_avx2(const mpc_run_t *r, const char *s, long n) {
+  
+  __m256i lo[MPC_RUN_RANGES], w[MPC_RUN_RANGES], x, d, in;
+  long k = 0;
+  int j;
+  unsigned int m;
+  
+  for (j = 0; j < r->n; j++) {
+    lo[j] = _mm256_set1_epi8((char)r->lo[j]);
+    w[j]  = _mm256_set1_epi8((char)(r->hi[j] - r->lo[j]));
+  }
+  
+  for (; k + 32 <= n; k += 32) {
+    x  = _mm256_loadu_si256((const __m256i*)(s + k));
+    in = _mm256_setzero_si256();
+    for (j = 0; j < r->n; j++) {
+      d  = _mm256_sub_epi8(x, lo[j]);
+      in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_max_epu8(d, w[j]), w[j]));
+    }
+    m = (unsigned int)_mm256_movemask_epi8(in);
+    if (m != 0xFFFFFFFFu) { return k + __builtin_ctz(~m); }
+  }
+  
+  /* Clear the upper halves before going back to SSE for the tail */
+  _mm256_zeroupper();
+  return k + mpc_run_sse2(r, s + k, n - k);
+}
+
+static long (*mpc_run_simd)(const mpc_run_t*, const char*, long) = NULL;
+
+static long mpc_run_scan(const mpc_run_t *r, const char *s, long n) {
+  
+  /* Most runs are short, so the first few bytes are tried one at a time */
+  
+  long k = mpc_run_scalar(r, s, n < 16 ? n : 16);
+  
+  if (k < 16 || r->n == 0) { return k < 16 ? k : k + mpc_run_scalar(r, s + k, n - k); }
+  if (mpc_run_simd == NULL) {
+    __builtin_cpu_init();
+    mpc_run_simd = __builtin_cpu_supports("avx2") ? mpc_run_avx2 : mpc_run_sse2;
+  }
+  return k + (n - k < 32 ? mpc_run_sse2(r, s + k, n - k) : mpc_run_simd(r, s + k, n - k));
+}
+
+#else
+
+static long mpc_run_scan(const mpc_run_t *r, const char *s, long n) {
+  return mpc_run_scalar(r, s, n);
+}
+
+#endif
+
+static int mpc_run_ranges_of(const unsigned char *set, unsigned char *lo, unsigned char *hi) {
+  
+  /* The ranges of bytes in `set`, or none when there are too many to be worth testing */
+  
+  int c, n = 0;
+  
+  for (c = 0; c < 256; c++) {
+    if (!mpc_class_has(set, (char)c)) { continue; }
+    if (n == MPC_RUN_RANGES) { return 0; }
+    lo[n] = c;
+    while (c < 255 && mpc_class_has(set, (char)(c + 1))) { c++; }
+    hi[n++] = c;
+  }
+  
+  return n;
+}
+
+static void mpc_run_class(mpc_run_t *r, const mpc_pdata_class_t *c) {
+  r->n = c->n;
+  r->lo = c->lo;
+  r->hi = c->hi;
+  r->set = c->n == 0 ? c->set : NULL;
+}
+
+static void mpc_input_skip(mpc_input_t *i, const char *s, long n) {
+  
+  /* Moves the input past the `n` characters at `s` in its window, all known to match */
+  
+  const char *e = s + n, *c = s, *nl = NULL;
+  
+  if (n == 0) { return; }
+  
+  while ((c = memchr(c, '\n', e - c)) != NULL) {
+    i->state.row++;
+    nl = c++;
+  }
+  
+  i->state.col = nl ? e - nl - 1 : i->state.col + n;
+  i->state.pos += n;
+  i->last = e[-1];
+}
+
+static char *mpc_input_run(mpc_input_t *i, mpc_parser_t *p, long *n) {
+  
+  mpc_run_t r;
+  unsigned char lo[2], hi[2];
+  const char *w;
+  long k, avail, slots = 0;
+  char *s = NULL;
+  
+  if (p->type == MPC_TYPE_SATISFY) {
+    return mpc_input_span(i, mpc_span_match, p, n);
+  }
+  
+  r.set = NULL;
+  r.lo = lo;
+  r.hi = hi;
+  
+  switch (p->type) {
+    case MPC_TYPE_ANY:
+      r.n = 1; lo[0] = 0; hi[0] = 255;
+    break;
+    case MPC_TYPE_SINGLE:
+      r.n = 1; lo[0] = hi[0] = (unsigned char)p->data.single.x;
+    break;
+    case MPC_TYPE_RANGE:
+      /* Ranges compare as `char`, so one spanning zero from below wraps around */
+      if (p->data.range.x > p->data.range.y) { r.n = 0; }
+      else if (p->data.range.x < 0 && p->data.range.y >= 0) {
+        r.n = 2;
+        lo[0] = 0; hi[0] = p->data.range.y;
+        lo[1] = (unsigned char)p->data.range.x; hi[1] = 255;
+      } else {
+        r.n = 1;
+        lo[0] = (unsigned char)p->data.range.x;
+        hi[0] = (unsigned char)p->data.range.y;
+      }
+    break;
+    default: mpc_run_class(&r, &p->data.class); break;
+  }
+  
+  /* A run reaching the end of the window carries on once more has been read */
+  
+  *n = 0;
+  while ((w = mpc_input_window(i, &avail)) && avail > 0) {
+    k = mpc_run_scan(&r, w, avail);
+    if (*n + k + 1 > slots) {
+      slots = slots * 2 > *n + k + 1 ? slots * 2 : *n + k + 1;
+      s = realloc(s, slots);
+    }
+    memcpy(s + *n, w, k);
+    *n += k;
+    mpc_input_skip(i, w, k);
+    if (k < avail) { break; }
+  }
+  
+  if (s == NULL) { s = malloc(1); }
+  s[*n] = '\0';
+  return s;
+}
+
 /*
 ** Stack Type
 */
 
+typedef union {
+  mpc_fault_t *error;
+  mpc_val_t *output;
+} mpc_res_t;
+
 typedef struct {
 
+  mpc_input_t *input;
+  
   int parsers_num;
   int parsers_slots;
   mpc_parser_t **parsers;
@@ -741,16 +1276,18 @@ typedef struct {
 
   int results_num;
   int results_slots;
-  mpc_result_t *results;
+  mpc_res_t *results;
   int *returns;
   
-  mpc_err_t *err;
+  mpc_fault_t *err;
   
 } mpc_stack_t;
 
-static mpc_stack_t *mpc_stack_new(const char *filename) {
+static mpc_stack_t *mpc_stack_new(mpc_input_t *i) {
   mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
   
+  s->input = i;
+  
   s->parsers_num = 0;
   s->parsers_slots = 0;
   s->parsers = NULL;
@@ -761,16 +1298,13 @@ static mpc_stack_t *mpc_stack_new(const char *filename) {
   s->results = NULL;
   s->returns = NULL;
   
-  s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
+  s->err = mpc_fault_fail(i, mpc_state_invalid(), "Unknown Error");
   
   return s;
 }
 
-static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
-  mpc_err_t *errs[2];
-  errs[0] = s->err;
-  errs[1] = e;
-  s->err = mpc_err_or(errs, 2);
+static void mpc_stack_err(mpc_stack_t *s, mpc_fault_t *e) {
+  s->err = mpc_fault_or(s->input, s->err, e);
 }
 
 static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
@@ -778,12 +1312,13 @@ static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
   
   if (success) {
     r->output = s->results[0].output;
-    mpc_err_delete(s->err);
   } else {
     mpc_stack_err(s, s->results[0].error);
-    r->error = s->err;
+    r->error = mpc_fault_export(s->input, s->err);
   }
   
+  mpc_fault_delete(s->input, s->err);
+  
   free(s->parsers);
   free(s->states);
   free(s->results);
@@ -799,17 +1334,18 @@ static void mpc_stack_set_state(mpc_stack_t *s, int x) {
   s->states[s->parsers_num-1] = x;
 }
 
+/*
+** Both stacks double when full and are never shrunk,
+** so once a parse has reached its deepest nesting
+** pushing and popping no longer touch the allocator.
+** They are freed as a whole when the parse finishes.
+*/
+
+enum { MPC_STACK_MIN = 64 };
+
 static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
   if (s->parsers_num > s->parsers_slots) {
-    s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-  }
-}
-
-static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
-  if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
-    s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
+    s->parsers_slots = s->parsers_slots ? s->parsers_slots * 2 : MPC_STACK_MIN;
     s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
     s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
   }
@@ -826,114 +1362,491 @@ static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
   *p = s->parsers[s->parsers_num-1];
   *st = s->states[s->parsers_num-1];
   s->parsers_num--;
-  mpc_stack_parsers_reserve_less(s);
 }
 
-static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
-  *p = s->parsers[s->parsers_num-1];
-  *st = s->states[s->parsers_num-1];
-}
+static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+  *p = s->parsers[s->parsers_num-1];
+  *st = s->states[s->parsers_num-1];
+}
+
+static int mpc_stack_empty(mpc_stack_t *s) {
+  return s->parsers_num == 0;
+}
+
+/* Stack Result Stuff */
+
+static mpc_res_t mpc_result_err(mpc_fault_t *e) {
+  mpc_res_t r;
+  r.error = e;
+  return r;
+}
+
+static mpc_res_t mpc_result_out(mpc_val_t *x) {
+  mpc_res_t r;
+  r.output = x;
+  return r;
+}
+
+static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
+  if (s->results_num > s->results_slots) {
+    s->results_slots = s->results_slots ? s->results_slots * 2 : MPC_STACK_MIN;
+    s->results = realloc(s->results, sizeof(mpc_res_t) * s->results_slots);
+    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
+  }
+}
+
+static void mpc_stack_pushr(mpc_stack_t *s, mpc_res_t x, int r) {
+  s->results_num++;
+  mpc_stack_results_reserve_more(s);
+  s->results[s->results_num-1] = x;
+  s->returns[s->results_num-1] = r;
+}
+
+static int mpc_stack_popr(mpc_stack_t *s, mpc_res_t *x) {
+  int r;
+  *x = s->results[s->results_num-1];
+  r = s->returns[s->results_num-1];
+  s->results_num--;
+  return r;
+}
+
+static int mpc_stack_peekr(mpc_stack_t *s, mpc_res_t *x) {
+  *x = s->results[s->results_num-1];
+  return s->returns[s->results_num-1];
+}
+
+static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
+  mpc_res_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    mpc_stack_err(s, x.error);
+    n--;
+  }
+}
+
+static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
+  mpc_res_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    ds[n-1](x.output);
+    n--;
+  }
+}
+
+static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
+  mpc_res_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    dx(x.output);
+    n--;
+  }
+}
+
+static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
+  mpc_res_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    n--;
+  }
+}
+
+static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
+  mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
+  mpc_stack_popr_n(s, n);
+  return x;
+}
+
+static mpc_fault_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
+  int j;
+  mpc_fault_t *x = s->results[s->results_num-n].error;
+  for (j = s->results_num-n+1; j < s->results_num; j++) {
+    x = mpc_fault_or(s->input, x, s->results[j].error);
+  }
+  mpc_stack_popr_n(s, n);
+  return x;
+}
+
+/*
+** DFAs
+**
+** Most regexes are just a run of character classes
+** each matched once, optionally or repeatedly. As mpc
+** never backtracks into a repetition such a regex has
+** one thing to do for each byte at each step, so
+** `mpc_re` compiles it to a table indexed by step and
+** byte giving the next step. It then runs as a single
+** primitive producing the span it matched.
+**
+** Each entry also holds which class matched the byte,
+** so the classes skipped over can be reported just as
+** the `many` and `maybe` parsers would have done, and
+** a flag for when a class made of an `or` tried some
+** alternatives before it, which it reports likewise.
+**
+** The combinator tree is kept alongside. When the
+** table rejects the input that is run instead so the
+** error is exactly the one it always gave, as it is
+** for zero bytes and when backtracking is disabled.
+*/
+
+enum {
+  MPC_DFA_ACCEPT = -2,
+  MPC_DFA_REJECT = -1,
+  MPC_DFA_INNER  = 0x8000
+};
+
+typedef struct {
+  mpc_parser_t *p;
+  int state;
+  int skip_from, skip_to;
+  mpc_state_t skip_state;
+  char skip_char;
+  int inner;
+  mpc_state_t inner_state;
+  char inner_char;
+} mpc_dfa_run_t;
+
+static int mpc_dfa_step(mpc_input_t *i, void *d) {
+  
+  mpc_dfa_run_t *r = d;
+  char c = mpc_input_peekc(i);
+  int next;
+  
+  if (mpc_input_terminated(i)) {
+    if (!r->p->data.dfa.final[r->state]) { r->state = MPC_DFA_REJECT; }
+    return 0;
+  }
+  
+  if (c == '\0') {
+    r->state = MPC_DFA_REJECT;
+    return 0;
+  }
+  
+  next = r->p->data.dfa.table[r->state * 256 + (unsigned char)c];
+  if (next < 0) {
+    if (next == MPC_DFA_REJECT) { r->state = next; }
+    return 0;
+  }
+  
+  if ((next >> 16) > r->state) {
+    r->skip_from = r->state;
+    r->skip_to = next >> 16;
+    r->skip_state = i->state;
+    r->skip_char = c;
+  }
+  
+  if (next & MPC_DFA_INNER) {
+    r->inner = next >> 16;
+    r->inner_state = i->state;
+    r->inner_char = c;
+  }
+  
+  r->state = next & 0x7FFF;
+  return mpc_input_success(i, mpc_input_getc(i), NULL);
+}
+
+static mpc_fault_t *mpc_dfa_err(mpc_input_t *i, mpc_parser_t *q, mpc_state_t s, char c) {
+  if (q->type == MPC_TYPE_EXPECT) {
+    return mpc_fault_new(i, s, q->data.expect.m, c);
+  }
+  return mpc_fault_fail(i, s, "Incorrect Input");
+}
+
+static void mpc_dfa_skip_err(mpc_input_t *i, mpc_stack_t *stk, mpc_dfa_run_t *r) {
+  int j;
+  for (j = r->skip_from; j < r->skip_to; j++) {
+    mpc_stack_err(stk, mpc_dfa_err(i, r->p->data.dfa.atoms[j], r->skip_state, r->skip_char));
+  }
+}
+
+static void mpc_dfa_inner_err(mpc_input_t *i, mpc_stack_t *stk, mpc_dfa_run_t *r) {
+  int j;
+  mpc_parser_t *q;
+  if (r->inner < 0) { return; }
+  q = r->p->data.dfa.atoms[r->inner]->data.expect.x;
+  for (j = 0; !mpc_span_accepts(mpc_span_char(q->data.or.xs[j]), r->inner_char); j++) {
+    mpc_stack_err(stk, mpc_dfa_err(i, q->data.or.xs[j], r->inner_state, r->inner_char));
+  }
+}
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_parser_t *p, mpc_stack_t *stk, char **o) {
+  
+  mpc_dfa_run_t r;
+  mpc_run_t loop;
+  const char *w;
+  long n, start, avail;
+  int j;
+  
+  if (i->backtrack < 1) { return 0; }
+  
+  r.p = p;
+  r.state = 0;
+  r.skip_from = r.skip_to = 0;
+  r.inner = -1;
+  
+  /* The mark also keeps the window holding everything matched, to copy out at the end */
+  mpc_input_mark(i);
+  start = i->state.pos;
+  
+  /* A repeated class loops on its own step, so the rest of its run can be scanned at once */
+  while (mpc_dfa_step(i, &r)) {
+    w = mpc_input_window(i, &avail);
+    mpc_run_class(&loop, &p->data.dfa.loops[r.state]);
+    mpc_input_skip(i, w, mpc_run_scan(&loop, w, avail));
+  }
+  
+  n = i->state.pos - start;
+  w = i->type == MPC_INPUT_STRING ? i->string + start : i->buffer + (start - i->buffer_pos);
+  *o = malloc(n + 1);
+  memcpy(*o, w, n);
+  (*o)[n] = '\0';
+  
+  if (r.state == MPC_DFA_REJECT) {
+    mpc_input_rewind(i);
+    free(*o);
+    return 0;
+  }
+  
+  mpc_input_unmark(i);
+  
+  /*
+  ** Only the furthest errors survive a merge. Those from
+  ** where the match ended are furthest if there are any,
+  ** otherwise they are the last of those from classes
+  ** skipped and alternatives tried, given in the order
+  ** they would have happened.
+  */
+  
+  if (r.state < p->data.dfa.n) {
+    for (j = r.state; j < p->data.dfa.n; j++) {
+      mpc_stack_err(stk, mpc_dfa_err(i, p->data.dfa.atoms[j], i->state, mpc_input_peekc(i)));
+    }
+  } else if (r.inner >= 0 && r.inner_state.pos < r.skip_state.pos && r.skip_from < r.skip_to) {
+    mpc_dfa_inner_err(i, stk, &r);
+    mpc_dfa_skip_err(i, stk, &r);
+  } else {
+    mpc_dfa_skip_err(i, stk, &r);
+    mpc_dfa_inner_err(i, stk, &r);
+  }
+  
+  return 1;
+}
+
+/*
+** Memo Table
+**
+** Parsers wrapped with `mpc_memo` remember their
+** result at each position they are run at. When
+** backtracking brings the parse back to the same
+** place the result is copied out of the table rather
+** than parsed again, which keeps parsing linear for
+** grammars that would otherwise retry the same rules
+** at the same positions over and over (packrat).
+**
+** The table is direct mapped on parser and position.
+** It starts small and doubles on a collision until it
+** reaches `mpc_memo_limit` slots, after which a new
+** entry evicts the one in its slot.
+*/
+
+typedef struct mpc_memo_t {
+  mpc_parser_t *p;
+  long pos;
+  int success;
+  mpc_res_t r;
+  mpc_state_t state;
+  char last;
+} mpc_memo_t;
+
+static int mpc_memo_max = 1 << 16;
 
-static int mpc_stack_empty(mpc_stack_t *s) {
-  return s->parsers_num == 0;
+void mpc_memo_limit(int n) {
+  mpc_memo_max = n;
 }
 
-/* Stack Result Stuff */
-
-static mpc_result_t mpc_result_err(mpc_err_t *e) {
-  mpc_result_t r;
-  r.error = e;
-  return r;
+static unsigned long mpc_memo_hash(mpc_parser_t *p, long pos) {
+  return ((unsigned long)(size_t)p >> 4) * 2654435761ul + (unsigned long)pos * 40503ul;
 }
 
-static mpc_result_t mpc_result_out(mpc_val_t *x) {
-  mpc_result_t r;
-  r.output = x;
-  return r;
+static void mpc_memo_clear(mpc_input_t *i, mpc_memo_t *m) {
+  if (m->p == NULL) { return; }
+  if (m->success && m->r.output) { m->p->data.memo.dx(m->r.output); }
+  if (!m->success) { mpc_fault_delete(i, m->r.error); }
+  m->p = NULL;
 }
 
-static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
-  if (s->results_num > s->results_slots) {
-    s->results_slots = ceil((s->results_slots + 1) * 1.5);
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
+static void mpc_input_memo_delete(mpc_input_t *i) {
+  int j;
+  for (j = 0; j < i->memo_slots; j++) {
+    mpc_memo_clear(i, &i->memo[j]);
   }
+  free(i->memo);
 }
 
-static void mpc_stack_results_reserve_less(mpc_stack_t *s) {
-  if ( s->results_slots > pow(s->results_num+1, 1.5)) {
-    s->results_slots = floor((s->results_slots-1) * (1.0/1.5));
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
+static void mpc_input_memo_grow(mpc_input_t *i) {
+  
+  /* Distinct slots stay distinct when the table doubles, so nothing is lost */
+  
+  int j, n = i->memo_slots ? i->memo_slots * 2 : 16;
+  mpc_memo_t *m = calloc(n, sizeof(mpc_memo_t));
+  
+  for (j = 0; j < i->memo_slots; j++) {
+    if (i->memo[j].p == NULL) { continue; }
+    m[mpc_memo_hash(i->memo[j].p, i->memo[j].pos) & (n-1)] = i->memo[j];
   }
+  
+  free(i->memo);
+  i->memo = m;
+  i->memo_slots = n;
 }
 
-static void mpc_stack_pushr(mpc_stack_t *s, mpc_result_t x, int r) {
-  s->results_num++;
-  mpc_stack_results_reserve_more(s);
-  s->results[s->results_num-1] = x;
-  s->returns[s->results_num-1] = r;
+static mpc_memo_t *mpc_input_memo_slot(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  return &i->memo[mpc_memo_hash(p, pos) & (i->memo_slots-1)];
 }
 
-static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
-  int r;
-  *x = s->results[s->results_num-1];
-  r = s->returns[s->results_num-1];
-  s->results_num--;
-  mpc_stack_results_reserve_less(s);
-  return r;
+static mpc_memo_t *mpc_input_memo_find(mpc_input_t *i, mpc_parser_t *p) {
+  
+  mpc_memo_t *m;
+  
+  if (i->memo_slots) {
+    m = mpc_input_memo_slot(i, p, i->state.pos);
+    if (m->p == p && m->pos == i->state.pos) {
+      i->stats.memo_hits++;
+      return m;
+    }
+  }
+  
+  i->stats.memo_misses++;
+  return NULL;
 }
 
-static int mpc_stack_peekr(mpc_stack_t *s, mpc_result_t *x) {
-  *x = s->results[s->results_num-1];
-  return s->returns[s->results_num-1];
+static mpc_res_t mpc_input_memo_restore(mpc_input_t *i, mpc_memo_t *m) {
+  
+  /* Moves the input to where the stored result ended and returns a copy of the result */
+  
+  i->state = m->state;
+  i->last = m->last;
+  
+  if (!m->success) { return mpc_result_err(mpc_fault_copy(i, m->r.error)); }
+  return mpc_result_out(m->r.output ? m->p->data.memo.copy(m->r.output) : NULL);
 }
 
-static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    mpc_stack_err(s, x.error);
-    n--;
+static void mpc_input_memo_store(mpc_input_t *i, mpc_parser_t *p, long pos, int success, mpc_res_t r) {
+  
+  mpc_memo_t *m;
+  
+  if (i->memo_slots == 0) { mpc_input_memo_grow(i); }
+  
+  m = mpc_input_memo_slot(i, p, pos);
+  while (m->p && i->memo_slots * 2 <= mpc_memo_max) {
+    mpc_input_memo_grow(i);
+    m = mpc_input_memo_slot(i, p, pos);
+  }
+  
+  if (m->p) {
+    mpc_memo_clear(i, m);
+    i->stats.memo_evictions++;
+  }
+  
+  m->p = p;
+  m->pos = pos;
+  m->success = success;
+  m->state = i->state;
+  m->last = i->last;
+  
+  if (success) {
+    m->r = mpc_result_out(r.output ? p->data.memo.copy(r.output) : NULL);
+  } else {
+    m->r = mpc_result_err(mpc_fault_copy(i, r.error));
   }
 }
 
-static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    ds[n-1](x.output);
-    n--;
-  }
+/*
+** Dispatch Tables
+**
+** After `mpc_optimise` each `or` holds the set of
+** bytes every alternative can start with and a
+** table from a byte to the first alternative that
+** might accept it. These look up the rest.
+**
+** Redefining a parser that is already defined can
+** change what the tables were built from, so it
+** bumps a counter. Tables built under an older
+** count are ignored until `mpc_optimise` is made
+** again and every alternative is tried in order.
+*/
+
+static int mpc_redefines = 0;
+
+static int mpc_dispatch_valid(mpc_parser_t *p) {
+  return p->data.or.dispatch && p->data.or.defines == mpc_redefines;
 }
 
-static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    dx(x.output);
-    n--;
-  }
+static int mpc_first_has(mpc_parser_t *p, int j, char c) {
+  return (p->data.or.first[j * 32 + (unsigned char)c / 8] >> ((unsigned char)c % 8)) & 1;
 }
 
-static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    n--;
+static int mpc_first_next(mpc_parser_t *p, char c, int j) {
+  while (j < p->data.or.n && !mpc_first_has(p, j, c)) { j++; }
+  return j;
+}
+
+/*
+** Streaming
+**
+** When parsing with an item callback, each AST matched
+** by a repetition is handed to it as soon as no parser
+** below it on the stack can backtrack, so nothing can
+** take it back again. It is then deleted and left out
+** of the result. The first leaves a NULL in its place,
+** so `many1` still counts it.
+*/
+
+static int mpc_stack_committed(mpc_stack_t *s) {
+  int j;
+  for (j = s->parsers_num-2; j >= 0; j--) {
+    switch (s->parsers[j]->type) {
+      case MPC_TYPE_OR:
+      case MPC_TYPE_NOT:
+      case MPC_TYPE_MAYBE:
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+      case MPC_TYPE_DFA:
+        return 0;
+    }
   }
+  return 1;
 }
 
-static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
-  mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
-  mpc_stack_popr_n(s, n);
-  return x;
+static int mpc_stack_stream(mpc_stack_t *s, mpc_parser_t *p, int st) {
+  
+  mpc_res_t r;
+  mpc_ast_t *a;
+  int j;
+  
+  if (s->input->item == NULL || p->data.repeat.f != mpcf_fold_ast) { return st; }
+  if (!mpc_stack_committed(s)) { return st; }
+  
+  mpc_stack_popr(s, &r);
+  mpc_input_commit(s->input);
+  
+  /* Nodes with children are passed on as `mpcf_fold_ast` would have spliced them in */
+  a = r.output;
+  if (a && a->children_num == 0) { s->input->item(a, s->input->item_data); }
+  if (a && a->children_num >  0) {
+    for (j = 0; j < a->children_num; j++) { s->input->item(a->children[j], s->input->item_data); }
+  }
+  mpc_ast_delete(a);
+  
+  if (st > 1) { return st-1; }
+  mpc_stack_pushr(s, mpc_result_out(NULL), 1);
+  return st;
 }
 
-static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
-  mpc_err_t *x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
-  mpc_stack_popr_n(s, n);
-  return x;
+static mpc_stats_t mpc_stats_last;
+
+void mpc_stats(mpc_stats_t *s) {
+  *s = mpc_stats_last;
 }
 
 /*
@@ -960,18 +1873,23 @@ static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
 #define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
 #define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
 #define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
-#define MPC_PRIMITIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
+#define MPC_PRIMITIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_fault_fail(i, i->state, "Incorrect Input")); }
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
   
   /* Stack */
   int st = 0;
   mpc_parser_t *p = NULL;
-  mpc_stack_t *stk = mpc_stack_new(i->filename);
+  mpc_stack_t *stk = mpc_stack_new(i);
   
   /* Variables */
   char *s;
-  mpc_result_t r;
+  long len;
+  int j;
+  mpc_parser_t *q;
+  mpc_memo_t *m;
+  mpc_res_t r;
+  mpc_fault_t *e;
 
   /* Go! */
   mpc_stack_pushp(stk, init);
@@ -987,16 +1905,16 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       case MPC_TYPE_ANY:       MPC_PRIMITIVE(s, mpc_input_any(i, &s));
       case MPC_TYPE_SINGLE:    MPC_PRIMITIVE(s, mpc_input_char(i, p->data.single.x, &s));
       case MPC_TYPE_RANGE:     MPC_PRIMITIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, &s));
-      case MPC_TYPE_ONEOF:     MPC_PRIMITIVE(s, mpc_input_oneof(i, p->data.string.x, &s));
-      case MPC_TYPE_NONEOF:    MPC_PRIMITIVE(s, mpc_input_noneof(i, p->data.string.x, &s));
+      case MPC_TYPE_ONEOF:     MPC_PRIMITIVE(s, mpc_input_class(i, p->data.class.set, &s));
+      case MPC_TYPE_NONEOF:    MPC_PRIMITIVE(s, mpc_input_class(i, p->data.class.set, &s));
       case MPC_TYPE_SATISFY:   MPC_PRIMITIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
       case MPC_TYPE_STRING:    MPC_PRIMITIVE(s, mpc_input_string(i, p->data.string.x, &s));
       
       /* Other parsers */
       
-      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
+      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_fault_fail(i, i->state, "Parser Undefined!"));      
       case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
+      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_fault_fail(i, i->state, p->data.fail.m));
       case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
       case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
       case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_state_copy(i->state));
@@ -1005,7 +1923,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (mpc_input_anchor(i, p->data.anchor.f)) {
           MPC_SUCCESS(NULL);
         } else {
-          MPC_FAILURE(mpc_err_new(i->filename, i->state, "anchor", mpc_input_peekc(i)));
+          MPC_FAILURE(mpc_fault_new(i, i->state, "anchor", mpc_input_peekc(i)));
         }
       
       /* Application Parsers */
@@ -1016,8 +1934,8 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (mpc_stack_popr(stk, &r)) {
             MPC_SUCCESS(r.output);
           } else {
-            mpc_err_delete(r.error); 
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, p->data.expect.m, mpc_input_peekc(i)));
+            mpc_fault_delete(i, r.error);
+            MPC_FAILURE(mpc_fault_new(i, i->state, p->data.expect.m, mpc_input_peekc(i)));
           }
         }
       
@@ -1059,7 +1977,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (mpc_stack_popr(stk, &r)) {
             mpc_input_rewind(i);
             p->data.not.dx(r.output);
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, "opposite", mpc_input_peekc(i)));
+            MPC_FAILURE(mpc_fault_new(i, i->state, "opposite", mpc_input_peekc(i)));
           } else {
             mpc_input_unmark(i);
             mpc_stack_err(stk, r.error);
@@ -1081,9 +1999,15 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       /* Repeat Parsers */
       
       case MPC_TYPE_MANY:
+        if (st == 0 && p->data.repeat.f == mpcf_strfold && (q = mpc_span_char(p->data.repeat.x))) {
+          s = mpc_input_run(i, q, &len);
+          mpc_stack_err(stk, mpc_span_err(i, p->data.repeat.x));
+          MPC_SUCCESS(s);
+        }
         if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
+            st = mpc_stack_stream(stk, p, st);
             MPC_CONTINUE(st+1, p->data.repeat.x);
           } else {
             mpc_stack_popr(stk, &r);
@@ -1093,14 +2017,24 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         }
       
       case MPC_TYPE_MANY1:
+        if (st == 0 && p->data.repeat.f == mpcf_strfold && (q = mpc_span_char(p->data.repeat.x))) {
+          s = mpc_input_run(i, q, &len);
+          if (len == 0) {
+            free(s);
+            MPC_FAILURE(mpc_fault_many1(i, mpc_span_err(i, p->data.repeat.x)));
+          }
+          mpc_stack_err(stk, mpc_span_err(i, p->data.repeat.x));
+          MPC_SUCCESS(s);
+        }
         if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
+            st = mpc_stack_stream(stk, p, st);
             MPC_CONTINUE(st+1, p->data.repeat.x);
           } else {
             if (st == 1) {
               mpc_stack_popr(stk, &r);
-              MPC_FAILURE(mpc_err_many1(r.error));
+              MPC_FAILURE(mpc_fault_many1(i, r.error));
             } else {
               mpc_stack_popr(stk, &r);
               mpc_stack_err(stk, r.error);
@@ -1116,7 +2050,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             mpc_stack_popr(stk, &r);
             mpc_stack_popr_out_single(stk, st-1, p->data.repeat.dx);
             mpc_input_rewind(i);
-            MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
+            MPC_FAILURE(mpc_fault_count(i, r.error, p->data.repeat.n));
           } else {
             if (st < p->data.repeat.n) {
               MPC_CONTINUE(st+1, p->data.repeat.x);
@@ -1133,6 +2067,11 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         
         if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
         
+        if (st == 0 && mpc_dispatch_valid(p)) {
+          j = p->data.or.dispatch[(unsigned char)mpc_input_peekc(i)];
+          if (j >= 0) { MPC_CONTINUE(p->data.or.n+1+j*p->data.or.n, p->data.or.xs[j]); }
+        }
+        
         if (st == 0) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
         if (st <= p->data.or.n) {
           if (mpc_stack_peekr(stk, &r)) {
@@ -1143,6 +2082,28 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
           if (st == p->data.or.n) { MPC_FAILURE(mpc_stack_merger_err(stk, p->data.or.n)); }
         }
+        
+        /*
+        ** Dispatched on the next byte, so only the alternatives which can
+        ** start with it are tried. The state holds which one is running and
+        ** how many have failed before it. Those skipped fail where this `or`
+        ** began, so if the tried ones fail further on their error is the whole
+        ** error. Otherwise fall back to trying everything for the full message.
+        */
+        
+        j = (st-p->data.or.n-1) / p->data.or.n;
+        len = (st-p->data.or.n-1) % p->data.or.n;
+        if (mpc_stack_peekr(stk, &r)) {
+          mpc_stack_popr(stk, &r);
+          mpc_stack_popr_err(stk, len);
+          MPC_SUCCESS(r.output);
+        }
+        j = mpc_first_next(p, mpc_input_peekc(i), j+1);
+        if (j < p->data.or.n) { MPC_CONTINUE(p->data.or.n+1+j*p->data.or.n+len+1, p->data.or.xs[j]); }
+        e = mpc_stack_merger_err(stk, len+1);
+        if (e->state.pos > i->state.pos) { MPC_FAILURE(e); }
+        mpc_fault_delete(i, e);
+        MPC_CONTINUE(1, p->data.or.xs[0]);
       
       case MPC_TYPE_AND:
         
@@ -1160,14 +2121,43 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, p->data.and.f)); }
         }
       
+      /* Compiled Regexes */
+      
+      case MPC_TYPE_DFA:
+        if (st == 0) {
+          if (mpc_input_dfa(i, p, stk, &s)) { MPC_SUCCESS(s); }
+          MPC_CONTINUE(1, p->data.dfa.x);
+        }
+        if (mpc_stack_popr(stk, &r)) { MPC_SUCCESS(r.output); } else { MPC_FAILURE(r.error); }
+      
+      /* Memoised Parsers */
+      
+      case MPC_TYPE_MEMO:
+        if (st == 0) {
+          if (mpc_memo_max <= 0 || i->state.pos >= INT_MAX) {
+            MPC_CONTINUE(-1, p->data.memo.x);
+          }
+          if ((m = mpc_input_memo_find(i, p))) {
+            r = mpc_input_memo_restore(i, m);
+            if (m->success) { MPC_SUCCESS(r.output); } else { MPC_FAILURE(r.error); }
+          }
+          MPC_CONTINUE(i->state.pos + 1, p->data.memo.x);
+        }
+        if (st != 0) {
+          len = mpc_stack_popr(stk, &r);
+          if (st > 0) { mpc_input_memo_store(i, p, st - 1, len, r); }
+          if (len) { MPC_SUCCESS(r.output); } else { MPC_FAILURE(r.error); }
+        }
+      
       /* End */
       
       default:
         
-        MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!"));
+        MPC_FAILURE(mpc_fault_fail(i, i->state, "Unknown Parser Type Id!"));
     }
   }
   
+  mpc_stats_last = i->stats;
   return mpc_stack_terminate(stk, final);
   
 }
@@ -1178,8 +2168,12 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
 #undef MPC_PRIMITIVE
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_n(filename, string, strlen(string), p, r);
+}
+
+int mpc_parse_n(const char *filename, const char *string, long length, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
+  mpc_input_t *i = mpc_input_new_string(filename, string, length);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -1201,6 +2195,27 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+static int mpca_parse_items_input(mpc_input_t *i, mpc_parser_t *p, mpca_item_t f, void *d, mpc_result_t *r) {
+  int x;
+  i->item = f;
+  i->item_data = d;
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpca_parse_items(const char *filename, const char *string, mpc_parser_t *p, mpca_item_t f, void *d, mpc_result_t *r) {
+  return mpca_parse_items_input(mpc_input_new_string(filename, string, strlen(string)), p, f, d, r);
+}
+
+int mpca_parse_items_file(const char *filename, FILE *file, mpc_parser_t *p, mpca_item_t f, void *d, mpc_result_t *r) {
+  return mpca_parse_items_input(mpc_input_new_file(filename, file), p, f, d, r);
+}
+
+int mpca_parse_items_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpca_item_t f, void *d, mpc_result_t *r) {
+  return mpca_parse_items_input(mpc_input_new_pipe(filename, pipe), p, f, d, r);
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
   FILE *f = fopen(filename, "rb");
@@ -1230,6 +2245,8 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.dispatch);
+  free(p->data.or.first);
   
 }
 
@@ -1254,6 +2271,10 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     
     case MPC_TYPE_ONEOF: 
     case MPC_TYPE_NONEOF:
+      free(p->data.class.x); 
+      free(p->data.class.set);
+      break;
+    
     case MPC_TYPE_STRING:
       free(p->data.string.x); 
       break;
@@ -1261,6 +2282,16 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      free(p->data.dfa.table);
+      free(p->data.dfa.final);
+      free(p->data.dfa.atoms);
+      free(p->data.dfa.loops[0].set);
+      free(p->data.dfa.loops);
+      break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1327,6 +2358,7 @@ mpc_parser_t *mpc_new(const char *name) {
 }
 
 mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  if (p->type != MPC_TYPE_UNDEFINED) { mpc_redefines++; }
   mpc_undefine_unretained(p, 1);
   p->type = MPC_TYPE_UNDEFINED;
   return p;
@@ -1335,6 +2367,7 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
 mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   
   if (p->retained) {
+    if (p->type != MPC_TYPE_UNDEFINED) { mpc_redefines++; }
     p->type = a->type;
     p->data = a->data;
   } else {
@@ -1355,7 +2388,11 @@ void mpc_cleanup(int n, ...) {
   va_list va;
   va_start(va, n);
   for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
-  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
+  /* These are deleted rather than redefined, so other grammars keep their tables */
+  for (i = 0; i < n; i++) {
+    mpc_undefine_unretained(list[i], 1);
+    list[i]->type = MPC_TYPE_UNDEFINED;
+  }
   for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
   va_end(va);  
 
@@ -1514,21 +2551,52 @@ mpc_parser_t *mpc_range(char s, char e) {
   return mpc_expectf(p, "character between '%c' and '%c'", s, e);
 }
 
-mpc_parser_t *mpc_oneof(const char *s) {
+/*
+** Character classes keep the bytes they accept
+** as a bitmap, built once here. `mpc_oneof` also
+** accepts the terminating '\0' and `mpc_noneof`
+** never does, just as `strchr` would have it.
+** The bitmap is allocated on its own so it does
+** not grow the data of every other parser.
+*/
+
+static mpc_parser_t *mpc_class(int type, const char *s, const unsigned char *set) {
   mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
+  p->type = type;
+  p->data.class.x = malloc(strlen(s) + 1);
+  strcpy(p->data.class.x, s);
+  p->data.class.set = malloc(32);
+  memcpy(p->data.class.set, set, 32);
+  p->data.class.n = mpc_run_ranges_of(set, p->data.class.lo, p->data.class.hi);
   return mpc_expectf(p, "one of '%s'", s);
 }
 
-mpc_parser_t *mpc_noneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
+static void mpc_class_add(unsigned char *set, char c) {
+  set[(unsigned char)c / 8] |= 1 << ((unsigned char)c % 8);
+}
+
+static void mpc_class_invert(unsigned char *set) {
+  int j;
+  for (j = 0; j < 32; j++) { set[j] = ~set[j]; }
+}
+
+static void mpc_class_fill(unsigned char *set, const char *s) {
+  memset(set, 0, 32);
+  mpc_class_add(set, '\0');
+  while (*s) { mpc_class_add(set, *s++); }
+}
+
+mpc_parser_t *mpc_oneof(const char *s) {
+  unsigned char set[32];
+  mpc_class_fill(set, s);
+  return mpc_class(MPC_TYPE_ONEOF, s, set);
+}
 
+mpc_parser_t *mpc_noneof(const char *s) {
+  unsigned char set[32];
+  mpc_class_fill(set, s);
+  mpc_class_invert(set);
+  return mpc_class(MPC_TYPE_NONEOF, s, set);
 }
 
 mpc_parser_t *mpc_satisfy(int(*f)(char)) {
@@ -1574,6 +2642,15 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t copy, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.copy = copy;
+  p->data.memo.dx = da;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -1635,6 +2712,8 @@ mpc_parser_t *mpc_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.dispatch = NULL;
+  p->data.or.first = NULL;
   
   va_start(va, n);  
   for (i = 0; i < n; i++) {
@@ -1941,67 +3020,271 @@ static const char *mpc_re_range_escape_char(char c) {
   }
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+/*
+** A range is built straight into the bitmap of
+** its class. The characters it spells out are
+** also kept as a string for the error message,
+** grown by doubling rather than one at a time.
+*/
+
+typedef struct {
+  char *s;
+  size_t len, slots;
+  unsigned char set[32];
+} mpc_re_range_t;
+
+static void mpc_re_range_add(mpc_re_range_t *r, char c) {
+  if (c == '\0') { return; }
+  if (r->len + 1 >= r->slots) {
+    r->slots = r->slots * 2;
+    r->s = realloc(r->s, r->slots);
+  }
+  r->s[r->len++] = c;
+  r->s[r->len] = '\0';
+  mpc_class_add(r->set, c);
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  
+  mpc_parser_t *out;
+  mpc_re_range_t r;
+  size_t i, j, n;
+  size_t start, end;
+  const char *tmp = NULL;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  n = strlen(s);
+  r.len = 0;
+  r.slots = n + 1;
+  r.s = calloc(1, r.slots);
+  mpc_class_fill(r.set, "");
+  
+  for (i = comp; i < n; i++){
+    
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        while (*tmp) { mpc_re_range_add(&r, *tmp++); }
+      } else {
+        mpc_re_range_add(&r, s[i+1]);
+      }
+      i++;
+    }
+    
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+        mpc_re_range_add(&r, '-');
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          mpc_re_range_add(&r, j);
+        }        
+      }
+    }
+    
+    /* Regex Range Normal */
+    else {
+      mpc_re_range_add(&r, s[i]);
+    }
+  
+  }
+  
+  if (comp) { mpc_class_invert(r.set); }
+  out = mpc_class(comp ? MPC_TYPE_NONEOF : MPC_TYPE_ONEOF, r.s, r.set);
+  
+  free(x);
+  free(r.s);
+  
+  return out;
+}
+
+/*
+** A regex can be compiled to a DFA when it is
+** just character classes joined by `and` and
+** repeated by `*`, `+`, `?` or `{n}`. It is
+** flattened into a list of classes each to be
+** matched once, at most once, or any number of
+** times, with `+` and `{n}` spelled out. Regexes
+** with more than `mpc_re_limit` classes are left
+** as combinators, and a limit of 0 keeps them all.
+*/
+
+enum {
+  MPC_DFA_ONE  = 0,
+  MPC_DFA_OPT  = 1,
+  MPC_DFA_STAR = 2,
+  MPC_DFA_MAX  = 256
+};
+
+typedef struct {
+  int n;
+  char kind[MPC_DFA_MAX];
+  unsigned char set[MPC_DFA_MAX][32];
+  mpc_parser_t *atom[MPC_DFA_MAX];
+} mpc_re_atoms_t;
+
+static int mpc_re_max = MPC_DFA_MAX;
+
+void mpc_re_limit(int n) {
+  mpc_re_max = n < MPC_DFA_MAX ? n : MPC_DFA_MAX;
+}
+
+static int mpc_re_class_add(mpc_parser_t *p, unsigned char *set) {
+  
+  int c;
+  
+  if ((p = mpc_span_char(p)) == NULL) { return 0; }
+  
+  for (c = 1; c < 256; c++) {
+    if (mpc_span_accepts(p, (char)c)) { set[c / 8] |= 1 << (c % 8); }
+  }
+  return 1;
+}
+
+static int mpc_re_class(mpc_parser_t *p, unsigned char *set) {
+  
+  /* A class is a single character parser or an expected `or` of them such as `\w` */
+  
+  int j;
+  
+  if (p->type == MPC_TYPE_EXPECT && p->data.expect.x->type == MPC_TYPE_OR) {
+    p = p->data.expect.x;
+    for (j = 0; j < p->data.or.n; j++) {
+      if (!mpc_re_class_add(p->data.or.xs[j], set)) { return 0; }
+    }
+    return p->data.or.n > 0;
+  }
+  
+  return mpc_re_class_add(p, set);
+}
+
+static int mpc_re_atom(mpc_re_atoms_t *a, mpc_parser_t *p, int kind, int count) {
+  
+  int j;
+  
+  if (a->n + count > mpc_re_max) { return 0; }
+  
+  memset(a->set[a->n], 0, 32);
+  if (!mpc_re_class(p, a->set[a->n])) { return 0; }
+  
+  for (j = 0; j < count; j++) {
+    a->kind[a->n + j] = kind;
+    a->atom[a->n + j] = p;
+    memcpy(a->set[a->n + j], a->set[a->n], 32);
+  }
+  a->n += count;
+  return 1;
+}
+
+static int mpc_re_atoms(mpc_re_atoms_t *a, mpc_parser_t *p) {
+  
+  int j;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_LIFT: return p->data.lift.lf == mpcf_ctor_str;
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_re_atoms(a, p->data.and.xs[j])) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_MAYBE:
+      return p->data.not.lf == mpcf_ctor_str
+        && mpc_re_atom(a, p->data.not.x, MPC_DFA_OPT, 1);
+    
+    case MPC_TYPE_MANY:
+      return p->data.repeat.f == mpcf_strfold
+        && mpc_re_atom(a, p->data.repeat.x, MPC_DFA_STAR, 1);
+    
+    case MPC_TYPE_MANY1:
+      return p->data.repeat.f == mpcf_strfold
+        && mpc_re_atom(a, p->data.repeat.x, MPC_DFA_ONE, 1)
+        && mpc_re_atom(a, p->data.repeat.x, MPC_DFA_STAR, 1);
+    
+    case MPC_TYPE_COUNT:
+      /* A count always matches at least once */
+      return p->data.repeat.f == mpcf_strfold
+        && mpc_re_atom(a, p->data.repeat.x, MPC_DFA_ONE, p->data.repeat.n > 1 ? p->data.repeat.n : 1);
+    
+    default: return mpc_re_atom(a, p, MPC_DFA_ONE, 1);
+  }
+}
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *x) {
   
-  mpc_parser_t *out;
-  size_t i, j;
-  size_t start, end;
-  const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+  /*
+  ** Step `k` is about to match class `k`. On a byte
+  ** it doesn't accept, optional and repeated classes
+  ** are skipped over to find the step which does.
+  ** Getting past the last class ends the match before
+  ** that byte, and a required class means a failure.
+  ** The class matched goes in the top half of entries.
+  */
   
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  int j, k, c, next;
+  mpc_parser_t *p;
+  mpc_re_atoms_t *a = malloc(sizeof(mpc_re_atoms_t));
   
-  for (i = comp; i < strlen(s); i++){
+  a->n = 0;
+  if (!mpc_re_atoms(a, x) || a->n == 0) {
+    free(a);
+    return x;
+  }
+  
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.x = x;
+  p->data.dfa.n = a->n;
+  p->data.dfa.table = malloc(sizeof(int) * 256 * (a->n + 1));
+  p->data.dfa.final = malloc(a->n + 1);
+  p->data.dfa.atoms = malloc(sizeof(mpc_parser_t*) * a->n);
+  p->data.dfa.loops = calloc(a->n + 1, sizeof(mpc_pdata_class_t));
+  p->data.dfa.loops[0].set = calloc(a->n + 1, 32);
+  for (k = 1; k <= a->n; k++) { p->data.dfa.loops[k].set = p->data.dfa.loops[0].set + k * 32; }
+  memcpy(p->data.dfa.atoms, a->atom, sizeof(mpc_parser_t*) * a->n);
+  
+  for (k = 0; k <= a->n; k++) {
     
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];      
+    p->data.dfa.table[k * 256] = MPC_DFA_REJECT;
+    for (c = 1; c < 256; c++) {
+      for (j = k; j < a->n; j++) {
+        if ((a->set[j][c / 8] >> (c % 8)) & 1) { break; }
+        if (a->kind[j] == MPC_DFA_ONE) { break; }
       }
-      i++;
-    }
-    
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = j;
-        }        
+      if (j == a->n) { next = MPC_DFA_ACCEPT; }
+      else if (!((a->set[j][c / 8] >> (c % 8)) & 1)) { next = MPC_DFA_REJECT; }
+      else {
+        next = (a->kind[j] == MPC_DFA_STAR ? j : j + 1) | (j << 16);
+        x = a->atom[j]->data.expect.x;
+        if (a->atom[j]->type == MPC_TYPE_EXPECT && x->type == MPC_TYPE_OR
+        && !mpc_span_accepts(mpc_span_char(x->data.or.xs[0]), (char)c)) {
+          next |= MPC_DFA_INNER;
+        }
       }
+      p->data.dfa.table[k * 256 + c] = next;
+      if (next == (k | (k << 16))) { mpc_class_add(p->data.dfa.loops[k].set, (char)c); }
     }
     
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
-    }
-  
+    p->data.dfa.loops[k].n = mpc_run_ranges_of(
+      p->data.dfa.loops[k].set, p->data.dfa.loops[k].lo, p->data.dfa.loops[k].hi);
+    
+    for (j = k; j < a->n && a->kind[j] != MPC_DFA_ONE; j++);
+    p->data.dfa.final[k] = j == a->n;
   }
   
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
-  
-  free(x);
-  free(range);
-  
-  return out;
+  free(a);
+  return p;
 }
 
 mpc_parser_t *mpc_re(const char *re) {
@@ -2059,7 +3342,7 @@ mpc_parser_t *mpc_re(const char *re) {
   mpc_delete(RegexEnclose);
   mpc_cleanup(5, Regex, Term, Factor, Base, Range);
   
-  return r.output;
+  return mpc_re_dfa(r.output);
   
 }
 
@@ -2282,13 +3565,22 @@ mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2)
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
   int i;
-  char *x = calloc(1, 1);
+  size_t l = 0;
+  char *x;
 
+  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+  
+  x = malloc(l + 1);
+  l = 0;
+  
   for (i = 0; i < n; i++) {
-    x = realloc(x, strlen(x) + strlen(xs[i]) + 1);
-    strcat(x, xs[i]);
+    size_t m = strlen(xs[i]);
+    memcpy(x + l, xs[i], m);
+    l += m;
     free(xs[i]);
   }
+  
+  x[l] = '\0';
   return x;
 }
 
@@ -2367,7 +3659,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   
   if (p->type == MPC_TYPE_ONEOF) {
     s = mpcf_escape_new(
-      p->data.string.x,
+      p->data.class.x,
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[%s]", s);
@@ -2376,7 +3668,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   
   if (p->type == MPC_TYPE_NONEOF) {
     s = mpcf_escape_new(
-      p->data.string.x,
+      p->data.class.x,
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[^%s]", s);
@@ -2395,6 +3687,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2430,6 +3724,271 @@ void mpc_print(mpc_parser_t *p) {
   printf("\n");
 }
 
+/*
+** Grammar Analysis
+**
+** `mpc_optimise` collects every parser reachable
+** from a grammar and works out which bytes each
+** can start with (its FIRST set) and if it can
+** succeed without consuming any input. Recursive
+** rules are handled by growing the sets until
+** nothing changes.
+**
+** Each `or` then gets a 256 entry table from the
+** next byte to the first alternative that could
+** accept it, so alternatives that can't match are
+** skipped without being run. Parsers that might
+** succeed on nothing, such as `maybe`, `not` or
+** anchors, can be followed by anything so they
+** count as starting with every byte. Parsers not
+** yet defined count the same way.
+**
+** The tables describe the grammar at the time of
+** the call. If any parser is redefined afterward
+** they are no longer used until this is called
+** again. Parsers defined for the first time don't
+** need this, as undefined ones were already
+** assumed to start with anything.
+*/
+
+typedef struct {
+  unsigned char set[32];
+  char nullable;
+} mpc_first_t;
+
+typedef struct {
+  int num, slots;
+  mpc_parser_t **ps;
+  mpc_first_t *fs;
+  int *hash;
+} mpc_grammar_t;
+
+static unsigned long mpc_grammar_hash(mpc_parser_t *p) {
+  return ((unsigned long)(size_t)p >> 4) * 2654435761ul;
+}
+
+static int mpc_grammar_find(mpc_grammar_t *g, mpc_parser_t *p) {
+  unsigned long h = mpc_grammar_hash(p);
+  while (g->hash[h & (g->slots*2-1)] >= 0) {
+    if (g->ps[g->hash[h & (g->slots*2-1)]] == p) { return g->hash[h & (g->slots*2-1)]; }
+    h++;
+  }
+  return -1;
+}
+
+static void mpc_grammar_add(mpc_grammar_t *g, mpc_parser_t *p) {
+  
+  int j;
+  unsigned long h;
+  
+  if (p == NULL || mpc_grammar_find(g, p) >= 0) { return; }
+  
+  /* The hash has twice the slots of the list, so it is rebuilt when the list grows */
+  if (g->num == g->slots) {
+    g->slots = g->slots * 2;
+    g->ps = realloc(g->ps, sizeof(mpc_parser_t*) * g->slots);
+    g->hash = realloc(g->hash, sizeof(int) * g->slots * 2);
+    for (j = 0; j < g->slots * 2; j++) { g->hash[j] = -1; }
+    for (j = 0; j < g->num; j++) {
+      h = mpc_grammar_hash(g->ps[j]);
+      while (g->hash[h & (g->slots*2-1)] >= 0) { h++; }
+      g->hash[h & (g->slots*2-1)] = j;
+    }
+  }
+  
+  h = mpc_grammar_hash(p);
+  while (g->hash[h & (g->slots*2-1)] >= 0) { h++; }
+  g->hash[h & (g->slots*2-1)] = g->num;
+  g->ps[g->num++] = p;
+}
+
+static mpc_parser_t *mpc_grammar_child(mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   return p->data.expect.x;
+    case MPC_TYPE_APPLY:    return p->data.apply.x;
+    case MPC_TYPE_APPLY_TO: return p->data.apply_to.x;
+    case MPC_TYPE_PREDICT:  return p->data.predict.x;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    return p->data.not.x;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    return p->data.repeat.x;
+    case MPC_TYPE_MEMO:     return p->data.memo.x;
+    case MPC_TYPE_DFA:      return p->data.dfa.x;
+    default: return NULL;
+  }
+}
+
+static void mpc_first_add(mpc_first_t *f, char c) {
+  f->set[(unsigned char)c / 8] |= 1 << ((unsigned char)c % 8);
+}
+
+static int mpc_first_union(mpc_first_t *f, mpc_first_t *g) {
+  int j, changed = 0;
+  for (j = 0; j < 32; j++) {
+    changed |= (f->set[j] | g->set[j]) != f->set[j];
+    f->set[j] |= g->set[j];
+  }
+  return changed;
+}
+
+static mpc_first_t *mpc_grammar_first(mpc_grammar_t *g, mpc_parser_t *p) {
+  return &g->fs[mpc_grammar_find(g, p)];
+}
+
+static int mpc_grammar_step(mpc_grammar_t *g, int k) {
+  
+  /* Recomputes one parser's FIRST set from its children, returning if it grew */
+  
+  int j, c, changed = 0;
+  char nullable = 0;
+  mpc_parser_t *p = g->ps[k];
+  mpc_first_t *f = &g->fs[k], *x;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_UNDEFINED:
+      memset(f->set, 0xFF, 32);
+      nullable = 1;
+    break;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_NOT:
+      nullable = 1;
+    break;
+    
+    case MPC_TYPE_FAIL: break;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0]) { mpc_first_add(f, p->data.string.x[0]); } else { nullable = 1; }
+    break;
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+      for (c = 1; c < 256; c++) {
+        if (mpc_span_accepts(p, (char)c)) { mpc_first_add(f, (char)c); }
+      }
+    break;
+    
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_MEMO:
+    case MPC_TYPE_DFA:
+      x = mpc_grammar_first(g, mpc_grammar_child(p));
+      changed |= mpc_first_union(f, x);
+      nullable = x->nullable;
+    break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_COUNT:
+      x = mpc_grammar_first(g, mpc_grammar_child(p));
+      changed |= mpc_first_union(f, x);
+      nullable = x->nullable || p->type != MPC_TYPE_COUNT || p->data.repeat.n == 0;
+    break;
+    
+    case MPC_TYPE_OR:
+      nullable = p->data.or.n == 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        x = mpc_grammar_first(g, p->data.or.xs[j]);
+        changed |= mpc_first_union(f, x);
+        nullable = nullable || x->nullable;
+      }
+    break;
+    
+    case MPC_TYPE_AND:
+      nullable = 1;
+      for (j = 0; j < p->data.and.n && nullable; j++) {
+        x = mpc_grammar_first(g, p->data.and.xs[j]);
+        changed |= mpc_first_union(f, x);
+        nullable = x->nullable;
+      }
+    break;
+    
+    default:
+      memset(f->set, 0xFF, 32);
+      nullable = 1;
+    break;
+  }
+  
+  changed |= nullable != f->nullable;
+  f->nullable = nullable;
+  return changed;
+}
+
+static void mpc_grammar_dispatch(mpc_grammar_t *g, mpc_parser_t *p) {
+  
+  int j, c;
+  mpc_first_t *x;
+  
+  free(p->data.or.dispatch);
+  free(p->data.or.first);
+  p->data.or.dispatch = malloc(sizeof(short) * 256);
+  p->data.or.first = malloc(32 * p->data.or.n);
+  p->data.or.defines = mpc_redefines;
+  
+  for (j = 0; j < p->data.or.n; j++) {
+    x = mpc_grammar_first(g, p->data.or.xs[j]);
+    if (x->nullable) { memset(p->data.or.first + j * 32, 0xFF, 32); }
+    else { memcpy(p->data.or.first + j * 32, x->set, 32); }
+  }
+  
+  /* A zero byte is also what end of input looks like so always try everything */
+  p->data.or.dispatch[0] = -1;
+  for (c = 1; c < 256; c++) {
+    j = mpc_first_next(p, (char)c, 0);
+    p->data.or.dispatch[c] = j < p->data.or.n ? j : -1;
+  }
+}
+
+void mpc_optimise(mpc_parser_t *p) {
+  
+  int j, k, changed;
+  mpc_grammar_t g;
+  
+  g.num = 0;
+  g.slots = 16;
+  g.ps = malloc(sizeof(mpc_parser_t*) * g.slots);
+  g.hash = malloc(sizeof(int) * g.slots * 2);
+  for (j = 0; j < g.slots * 2; j++) { g.hash[j] = -1; }
+  
+  /* The list doubles as the queue for the walk */
+  mpc_grammar_add(&g, p);
+  for (k = 0; k < g.num; k++) {
+    p = g.ps[k];
+    mpc_grammar_add(&g, mpc_grammar_child(p));
+    if (p->type == MPC_TYPE_OR)  { for (j = 0; j < p->data.or.n; j++)  { mpc_grammar_add(&g, p->data.or.xs[j]); } }
+    if (p->type == MPC_TYPE_AND) { for (j = 0; j < p->data.and.n; j++) { mpc_grammar_add(&g, p->data.and.xs[j]); } }
+  }
+  
+  g.fs = calloc(g.num, sizeof(mpc_first_t));
+  
+  /* Children are mostly found after parents so going backwards settles quickly */
+  do {
+    changed = 0;
+    for (k = g.num-1; k >= 0; k--) { changed |= mpc_grammar_step(&g, k); }
+  } while (changed);
+  
+  for (k = 0; k < g.num; k++) {
+    if (g.ps[k]->type == MPC_TYPE_OR && g.ps[k]->data.or.n > 0) { mpc_grammar_dispatch(&g, g.ps[k]); }
+  }
+  
+  free(g.ps);
+  free(g.fs);
+  free(g.hash);
+}
+
 /*
 ** Testing
 */
@@ -2498,50 +4057,292 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 
 /*
 ** AST
+**
+** Nodes are carved out of large blocks shared by all
+** trees, each with its contents stored right after it,
+** so building a tree costs no malloc per node. A block
+** counts the nodes still living in it and is freed
+** once the last of them is deleted, so trees and their
+** subtrees can still be kept or dropped independently.
+**
+** Tags are interned. Every node with the same tag
+** points at the one copy, and adding a tag in front
+** is a lookup, usually answered from the last one made
+** on that tag. Each interned tag also records the ids
+** of the `|` separated names it is made of, which is
+** what `mpc_ast_has_tag` tests. Trees may outlive any
+** parser, so the table is only freed when the program
+** calls `mpc_ast_cleanup`, along with the current
+** block if no node is left in it.
 */
 
+typedef struct mpc_tag_t {
+  int id;
+  int parts_num;
+  int *parts;
+  char *str;
+  struct mpc_tag_t *add_t;
+  struct mpc_tag_t *add_r;
+} mpc_tag_t;
+
+static mpc_tag_t **mpc_tags = NULL;
+static int mpc_tags_num = 0;
+static int mpc_tags_slots = 0;
+
+static unsigned long mpc_tag_hash(const char *s, long n) {
+  unsigned long h = 5381;
+  while (n--) { h = h * 33 + (unsigned char)*s++; }
+  return h;
+}
+
+static mpc_tag_t *mpc_tag_of(const char *str) {
+  /* The string of an interned tag sits right after its entry */
+  return ((mpc_tag_t*)str) - 1;
+}
+
+static mpc_tag_t *mpc_tag_intern(const char *s, long n) {
+  
+  int j, k, parts_num = 1;
+  int *parts;
+  unsigned long h;
+  mpc_tag_t *t, **tags;
+  
+  for (j = 0; j < n; j++) { parts_num += s[j] == '|'; }
+  
+  if (mpc_tags_num * 4 >= mpc_tags_slots * 3) {
+    k = mpc_tags_slots ? mpc_tags_slots * 2 : 64;
+    tags = calloc(k, sizeof(mpc_tag_t*));
+    for (j = 0; j < mpc_tags_slots; j++) {
+      if (mpc_tags[j] == NULL) { continue; }
+      h = mpc_tag_hash(mpc_tags[j]->str, strlen(mpc_tags[j]->str)) & (k-1);
+      while (tags[h]) { h = (h + 1) & (k-1); }
+      tags[h] = mpc_tags[j];
+    }
+    free(mpc_tags);
+    mpc_tags = tags;
+    mpc_tags_slots = k;
+  }
+  
+  h = mpc_tag_hash(s, n) & (mpc_tags_slots-1);
+  while ((t = mpc_tags[h])) {
+    if (strncmp(t->str, s, n) == 0 && t->str[n] == '\0') { return t; }
+    h = (h + 1) & (mpc_tags_slots-1);
+  }
+  
+  /* The parts are interned first, as that may grow the table under us */
+  parts = malloc(sizeof(int) * parts_num);
+  if (parts_num > 1) {
+    for (j = 0, k = 0; k < parts_num; k++) {
+      long m = 0;
+      while (j + m < n && s[j + m] != '|') { m++; }
+      parts[k] = mpc_tag_intern(s + j, m)->id;
+      j += m + 1;
+    }
+    h = mpc_tag_hash(s, n) & (mpc_tags_slots-1);
+    while (mpc_tags[h]) { h = (h + 1) & (mpc_tags_slots-1); }
+  }
+  
+  t = malloc(sizeof(mpc_tag_t) + n + 1);
+  t->str = (char*)(t + 1);
+  memcpy(t->str, s, n);
+  t->str[n] = '\0';
+  t->id = mpc_tags_num++;
+  t->parts_num = parts_num;
+  t->parts = parts;
+  if (parts_num == 1) { parts[0] = t->id; }
+  t->add_t = NULL;
+  t->add_r = NULL;
+  
+  mpc_tags[h] = t;
+  return t;
+}
+
+int mpc_tag_id(const char *t) {
+  return mpc_tag_intern(t, strlen(t))->id;
+}
+
+int mpc_ast_tag_id(mpc_ast_t *a) {
+  return mpc_tag_of(a->tag)->id;
+}
+
+int mpc_ast_has_tag(mpc_ast_t *a, int id) {
+  int j;
+  mpc_tag_t *t = mpc_tag_of(a->tag);
+  if (t->id == id) { return 1; }
+  for (j = 0; j < t->parts_num; j++) {
+    if (t->parts[j] == id) { return 1; }
+  }
+  return 0;
+}
+
+typedef struct mpc_ast_block_t {
+  long live;
+  long used;
+  long size;
+} mpc_ast_block_t;
+
+typedef struct {
+  mpc_ast_t ast;
+  mpc_ast_block_t *block;
+} mpc_ast_node_t;
+
+enum {
+  MPC_AST_BLOCK = 1 << 16,
+  MPC_AST_ALIGN = 16
+};
+
+static mpc_ast_block_t *mpc_ast_block = NULL;
+
+void mpc_ast_cleanup(void) {
+  
+  int j;
+  
+  for (j = 0; j < mpc_tags_slots; j++) {
+    if (mpc_tags[j] == NULL) { continue; }
+    free(mpc_tags[j]->parts);
+    free(mpc_tags[j]);
+  }
+  free(mpc_tags);
+  mpc_tags = NULL;
+  mpc_tags_num = 0;
+  mpc_tags_slots = 0;
+  
+  if (mpc_ast_block && mpc_ast_block->live == 0) {
+    free(mpc_ast_block);
+    mpc_ast_block = NULL;
+  }
+  
+}
+
+static mpc_ast_t *mpc_ast_alloc(char *tag, const char *contents, long len) {
+  
+  long need = (sizeof(mpc_ast_node_t) + len + 1 + MPC_AST_ALIGN-1) & ~(long)(MPC_AST_ALIGN-1);
+  mpc_ast_block_t *b = mpc_ast_block;
+  mpc_ast_node_t *n;
+  
+  if (need > MPC_AST_BLOCK / 4) {
+    /* Large contents get a block to themselves */
+    b = malloc(sizeof(mpc_ast_block_t) + need);
+    b->live = 0;
+    b->used = 0;
+    b->size = need;
+  } else if (b == NULL || b->used + need > b->size) {
+    if (b && b->live == 0) {
+      b->used = 0;
+    } else {
+      b = malloc(sizeof(mpc_ast_block_t) + MPC_AST_BLOCK);
+      b->live = 0;
+      b->used = 0;
+      b->size = MPC_AST_BLOCK;
+      mpc_ast_block = b;
+    }
+  }
+  
+  n = (mpc_ast_node_t*)((char*)(b + 1) + b->used);
+  b->used += need;
+  b->live++;
+  
+  n->block = b;
+  n->ast.tag = tag;
+  n->ast.contents = (char*)(n + 1);
+  memcpy(n->ast.contents, contents, len);
+  n->ast.contents[len] = '\0';
+  n->ast.state = mpc_state_new();
+  n->ast.children_num = 0;
+  n->ast.children = NULL;
+  return &n->ast;
+}
+
+static void mpc_ast_free(mpc_ast_t *a) {
+  
+  mpc_ast_block_t *b = ((mpc_ast_node_t*)a)->block;
+  
+  free(a->children);
+  
+  b->live--;
+  if (b->live > 0) { return; }
+  if (b == mpc_ast_block) { b->used = 0; } else { free(b); }
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
   
-  int i;
+  /* Nodes waiting to be freed are kept on a stack rather than recursing, so deeply nested trees are fine */
+  mpc_ast_t **stk = NULL;
+  int num = 0, slots = 0;
   
   if (a == NULL) { return; }
   
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
+  while (1) {
+    
+    if (num + a->children_num > slots) {
+      while (num + a->children_num > slots) { slots = slots ? slots * 2 : 16; }
+      stk = realloc(stk, sizeof(mpc_ast_t*) * slots);
+    }
+    if (a->children_num) {
+      memcpy(stk + num, a->children, sizeof(mpc_ast_t*) * a->children_num);
+      num += a->children_num;
+    }
+    
+    mpc_ast_free(a);
+    
+    if (num == 0) { break; }
+    a = stk[--num];
   }
   
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  free(stk);
   
 }
 
-static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+static mpc_ast_t *mpc_ast_copy_node(mpc_ast_t *a) {
+  
+  mpc_ast_t *b = mpc_ast_alloc(a->tag, a->contents, strlen(a->contents));
+  b->state = a->state;
+  b->children_num = a->children_num;
+  b->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  return b;
+  
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
   
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  /* Nodes still to have their children copied are kept on a stack, as in mpc_ast_delete */
+  mpc_ast_t **stk = NULL;
+  int num = 0, slots = 0, j;
+  mpc_ast_t *r, *x, *y;
   
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  if (a == NULL) { return NULL; }
   
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
+  r = mpc_ast_copy_node(a);
+  x = a;
+  y = r;
   
-  a->state = mpc_state_new();
+  while (1) {
+    
+    if (num + 2 * x->children_num > slots) {
+      while (num + 2 * x->children_num > slots) { slots = slots ? slots * 2 : 16; }
+      stk = realloc(stk, sizeof(mpc_ast_t*) * slots);
+    }
+    
+    for (j = 0; j < x->children_num; j++) {
+      y->children[j] = mpc_ast_copy_node(x->children[j]);
+      stk[num++] = x->children[j];
+      stk[num++] = y->children[j];
+    }
+    
+    if (num == 0) { break; }
+    y = stk[--num];
+    x = stk[--num];
+  }
   
-  a->children_num = 0;
-  a->children = NULL;
-  return a;
+  free(stk);
+  return r;
   
 }
 
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  return mpc_ast_alloc(mpc_tag_intern(tag, strlen(tag))->str, contents, strlen(contents));
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
   
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -2550,8 +4351,10 @@ mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
   va_list va;
   va_start(va, tag);
   
+  a->children_num = n;
+  a->children = n ? malloc(sizeof(mpc_ast_t*) * n) : NULL;
   for (i = 0; i < n; i++) {
-    mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
+    a->children[i] = va_arg(va, mpc_ast_t*);
   }
   
   va_end(va);
@@ -2577,7 +4380,7 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   
   int i;
 
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  if (a->tag != b->tag) { return 0; }
   if (strcmp(a->contents, b->contents) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
   
@@ -2596,17 +4399,37 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+  
+  mpc_tag_t *x;
+  char *s;
+  long n, m;
+  
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
+  
+  /* The same tag is almost always added to the same old one again */
+  x = mpc_tag_of(a->tag);
+  if (x->add_t && strcmp(x->add_t->str, t) == 0) {
+    a->tag = x->add_r->str;
+    return a;
+  }
+  
+  n = strlen(t);
+  m = strlen(a->tag);
+  s = malloc(n + 1 + m + 1);
+  memcpy(s, t, n);
+  s[n] = '|';
+  memcpy(s + n + 1, a->tag, m + 1);
+  
+  x->add_t = mpc_tag_intern(t, n);
+  x->add_r = mpc_tag_intern(s, n + 1 + m);
+  free(s);
+  
+  a->tag = x->add_r->str;
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
+  a->tag = mpc_tag_intern(t, strlen(t))->str;
   return a;
 }
 
@@ -2652,7 +4475,7 @@ void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
 
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   
-  int i, j;
+  int i, k;
   mpc_ast_t** as = (mpc_ast_t**)xs;
   mpc_ast_t *r;
   
@@ -2663,20 +4486,24 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   
   r = mpc_ast_new(">", "");
   
+  /* Children are counted first so the array is only allocated once */
+  for (i = 0, k = 0; i < n; i++) {
+    if (as[i] == NULL) { continue; }
+    k += as[i]->children_num > 0 ? as[i]->children_num : 1;
+  }
+  
+  r->children = k ? malloc(sizeof(mpc_ast_t*) * k) : NULL;
+  
   for (i = 0; i < n; i++) {
     
     if (as[i] == NULL) { continue; }
     
-    if (as[i] && as[i]->children_num > 0) {
-      
-      for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
-      }
-      
-      mpc_ast_delete_no_children(as[i]);
-      
-    } else if (as[i] && as[i]->children_num == 0) {
-      mpc_ast_add_child(r, as[i]);
+    if (as[i]->children_num > 0) {
+      memcpy(r->children + r->children_num, as[i]->children, sizeof(mpc_ast_t*) * as[i]->children_num);
+      r->children_num += as[i]->children_num;
+      mpc_ast_free(as[i]);
+    } else {
+      r->children[r->children_num++] = as[i];
     }
   
   }
@@ -2735,6 +4562,8 @@ mpc_parser_t *mpca_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.dispatch = NULL;
+  p->data.or.first = NULL;
   
   va_start(va, n);  
   for (i = 0; i < n; i++) {
@@ -3074,12 +4903,16 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   mpca_stmt_t *stmt;
   mpca_stmt_t **stmts = x;
   mpc_parser_t *left;
+  int i;
 
   while(*stmts) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_PACKRAT) {
+      stmt->grammar = mpc_memo(stmt->grammar, (mpc_apply_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete);
+    }
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
     free(stmt->name);
@@ -3088,6 +4921,10 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   }
   free(x);
   
+  for (i = 0; i < st->parsers_num; i++) {
+    mpc_optimise(st->parsers[i]);
+  }
+  
   return NULL;
 }
 
@@ -3212,7 +5049,7 @@ mpc_err_t *mpca_lang(int flags, const char *language, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_string("<mpca_lang>", language);
+  i = mpc_input_new_string("<mpca_lang>", language, strlen(language));
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -17,6 +17,20 @@
 #include <math.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
+
+/*
+** Threads
+**
+** Some state is shared by every parser and result: the
+** interned AST tags and the block new AST nodes come
+** from, the count of redefinitions `mpc_optimise`
+** checks its tables against, the counters `mpc_stats`
+** reports, the limits set by `mpc_memo_limit` and
+** `mpc_re_limit`, and the choice of SIMD scanner. None
+** of it is locked, so mpc must not be used from more
+** than one thread at once.
+*/
 
 /*
 ** State Type
@@ -61,10 +75,25 @@ struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_n(const char *filename, const char *string, long length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Statistics
+*/
+
+typedef struct {
+  long memo_hits;
+  long memo_misses;
+  long memo_evictions;
+  long marks;
+  long rewinds;
+} mpc_stats_t;
+
+void mpc_stats(mpc_stats_t *s);
+
 /*
 ** Function Types
 */
@@ -134,6 +163,11 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
 
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t copy, mpc_dtor_t da);
+void mpc_memo_limit(int n);
+
+void mpc_optimise(mpc_parser_t *p);
+
 /*
 ** Common Parsers
 */
@@ -250,11 +284,21 @@ mpc_val_t *mpcf_maths(int n, mpc_val_t** xs);
 */
 
 mpc_parser_t *mpc_re(const char *re);
+void mpc_re_limit(int n);
   
 /*
 ** AST
 */
 
+/*
+** `tag` points into a table of interned tags shared by
+** every tree, and `contents` into a block shared with
+** other nodes. Neither may be freed, reallocated or
+** written to; change a tag with `mpc_ast_tag` or
+** `mpc_ast_add_tag`. The tag table is kept until
+** `mpc_ast_cleanup` is called.
+*/
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
@@ -270,20 +314,61 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
 
+/*
+** Frees the tag table and the idle AST block. Call it
+** once no tree is left and no tag id from before will
+** be used again, such as at the end of the program.
+** Tags are interned afresh, with new ids, if mpc is
+** used afterward.
+*/
+void mpc_ast_cleanup(void);
+
 /*
 ** Warning: This function currently doesn't test for equality of the `state` member!
 */
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b);
 
+/*
+** Tag ids give a cheap test for one of the `|` separated names.
+*/
+int mpc_tag_id(const char *t);
+int mpc_ast_tag_id(mpc_ast_t *a);
+int mpc_ast_has_tag(mpc_ast_t *a, int id);
+
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
 
+/*
+** Items
+**
+** Parsing with an item callback passes each AST matched
+** by a repetition to `f` once nothing can backtrack
+** over it, in order, and then deletes it. A match with
+** children is passed as its children, one call each,
+** the way it would have been added to the result.
+**
+** Each item is a whole subtree, built before the call
+** and valid only during it. Nothing is passed while an
+** item is still being matched, so memory is bounded by
+** the largest item rather than the whole input, but
+** not by nesting depth. Whatever was not passed on is
+** returned in the result as usual, which is NULL if
+** nothing was left.
+*/
+
+typedef void(*mpca_item_t)(mpc_ast_t*,void*);
+
+int mpca_parse_items(const char *filename, const char *string, mpc_parser_t *p, mpca_item_t f, void *d, mpc_result_t *r);
+int mpca_parse_items_file(const char *filename, FILE *file, mpc_parser_t *p, mpca_item_t f, void *d, mpc_result_t *r);
+int mpca_parse_items_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpca_item_t f, void *d, mpc_result_t *r);
+
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
@@ -303,7 +388,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -0,0 +1,60 @@
+1
+-7
+x
+()
+{}
+{1 2 (3 4) {5}}
+(+ 1 2)
+(+ 1 2 3 4 5 6 7 8 9 10)
+(- 5)
+(- 10 4 3)
+(* 6 7)
+(/ 84 2)
+(/ 7 2)
+(/ -7 2)
+(/ 1 0)
+(+ 1 (* 2 3) (- 10 4))
+(+ 1 {2})
+(+ 1 x)
+(+)
+(*)
+4611686018427387904
+-4611686018427387905
+(list 1 2 3)
+(list)
+(head {1 2 3})
+(head {})
+(head 1)
+(head {1} {2})
+(tail {1 2 3})
+(tail {})
+(tail {1})
+(join {1 2} {3} {} {4 5})
+(join {1} 2)
+(join)
+(eval {+ 1 2})
+(eval {})
+(eval 1)
+(eval (list + 1 2))
+(eval {head {1 2}})
+(eval (head {(+ 1 1)}))
+(eval (tail {5 + 1 2}))
+(eval {eval {eval {+ 1 2}}})
+((+ 1 2))
+(1 2 3)
+(x 1 2)
+((head {+ -}) 1 2)
+((eval (head {+ -})) 10 4)
+((eval {head {+ -}}) 10 4)
+(eval (join {-} (list 10 3)))
+(head (list (+ 1 1) (/ 1 0) (+ 2 2)))
+(+ (head (list (* 2 3) 4)) (head (tail (list 5 6 7))))
+(eval (join (list +) (tail {0 1 2 3})))
+(join (list (list 1) {2}) (tail (list 3 (list 4))))
+(list (eval {+ 1 1}) {eval {+ 1 1}} (list))
+(- (eval {* 6 7}) (eval (list - 50 8)))
+(+ 1 (eval {(+ 2 3)}))
+(eval {(eval {+}) 2 3})
+(head (join {} {} {x y}))
+(tail (tail (tail (tail {1 2 3 4 5}))))
+(eval (list (head (list head)) {9 8}))
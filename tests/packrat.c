@@ -0,0 +1,126 @@
+// Parses the same inputs with a backtracking grammar built with and
+// without MPCA_LANG_PACKRAT, for string and file input, and fails if any
+// tree or error message differs. The grammar retries the same rules at
+// the same positions, so memo hits on both successes and failures are
+// exercised, as is merging the errors of memoised failures.
+
+#include "../mpc.h"
+
+static const char* grammar =
+  " expr   : <term> '+' <expr> | <term> '-' <expr> | <term> ;        "
+  " term   : <factor> '*' <term> | <factor> '/' <term> | <factor> ;  "
+  " factor : <pair> | '(' <expr> ')' | <num> | <name> ;             "
+  " pair   : '(' <expr> ',' <expr> ')' ;                             "
+  " num    : /[0-9]+/ ;                                              "
+  " name   : /[a-z]+/ ;                                              "
+  " top    : /^/ <expr> /$/ ;                                        ";
+
+static const char* inputs[] = {
+  "1",
+  "1 + 2 * 3",
+  "a * (b + c) / 4 - 5",
+  "(1, 2)",
+  "((1 + 2), (3 * (4 - x)))",
+  "(((1 + 2) * 3) - 4) / 5",
+  "(((x)))",
+  "(((x, y)))",
+  "((1 + 2 * (3, 4 * 6)) - 7)",
+  // failing parses
+  "",
+  "1 +",
+  "(1, 2",
+  "(((x))",
+  "(((x, y))) )",
+  "1 + (2 * (3 - (4, 5 +)))",
+  "a b",
+  "(1 + 2, )",
+  "1 * / 2",
+  NULL
+};
+
+static char* parse(mpc_parser_t* top, const char* input, int file) {
+  // Returns the printed tree or error for input, which the caller frees
+  mpc_result_t r;
+  int ok;
+
+  if (file) {
+    FILE* f = tmpfile();
+    fputs(input, f);
+    rewind(f);
+    ok = mpc_parse_file("<test>", f, top, &r);
+    fclose(f);
+  } else {
+    ok = mpc_parse("<test>", input, top, &r);
+  }
+
+  if (!ok) {
+    char* s = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    return s;
+  }
+
+  FILE* f = tmpfile();
+  mpc_ast_print_to(r.output, f);
+  mpc_ast_delete(r.output);
+  long n = ftell(f);
+  rewind(f);
+  char* s = malloc(n + 1);
+  s[fread(s, 1, n, f)] = '\0';
+  fclose(f);
+  return s;
+}
+
+int main(void) {
+  mpc_parser_t* p[2][7];
+  int failures = 0;
+  long hits = 0;
+
+  for (int k = 0; k < 2; k++) {
+    p[k][0] = mpc_new("expr");
+    p[k][1] = mpc_new("term");
+    p[k][2] = mpc_new("factor");
+    p[k][3] = mpc_new("pair");
+    p[k][4] = mpc_new("num");
+    p[k][5] = mpc_new("name");
+    p[k][6] = mpc_new("top");
+    mpc_err_t* e = mpca_lang(k ? MPCA_LANG_PACKRAT : MPCA_LANG_DEFAULT, grammar,
+			     p[k][0], p[k][1], p[k][2], p[k][3], p[k][4], p[k][5], p[k][6], NULL);
+    if (e) {
+      mpc_err_print(e);
+      mpc_err_delete(e);
+      return 1;
+    }
+  }
+
+  for (int i = 0; inputs[i]; i++) {
+    for (int file = 0; file < 2; file++) {
+      char* plain = parse(p[0][6], inputs[i], file);
+      char* memo = parse(p[1][6], inputs[i], file);
+      mpc_stats_t st;
+      mpc_stats(&st);
+      hits += st.memo_hits;
+
+      if (strcmp(plain, memo) != 0) {
+	printf("packrat mismatch on \"%s\" (%s input)\n", inputs[i], file ? "file" : "string");
+	printf("without packrat:\n%s\nwith packrat:\n%s\n", plain, memo);
+	failures++;
+      }
+      free(plain);
+      free(memo);
+    }
+  }
+
+  if (hits == 0) {
+    printf("packrat parses never hit the memo table\n");
+    failures++;
+  }
+
+  for (int k = 0; k < 2; k++) {
+    mpc_cleanup(7, p[k][0], p[k][1], p[k][2], p[k][3], p[k][4], p[k][5], p[k][6]);
+  }
+  mpc_ast_cleanup();
+
+  printf("packrat: %d inputs, %ld memo hits, %d failures\n",
+	 (int)(sizeof(inputs) / sizeof(inputs[0])) - 1, hits, failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+// Redefines rules of a grammar after mpca_lang has built its dispatch
+// tables and checks the parses follow the new definitions. Each input
+// gives the tag of the alternative that should match it, or NULL if it
+// should fail.
+
+#include "../mpc.h"
+
+static const char* grammar =
+  " first  : 'a' ;                  "
+  " second : 'c' ;                  "
+  " top    : /^/ (<first> | <second>) /$/ ; ";
+
+typedef struct {
+  const char* input;
+  const char* tag;
+} check_t;
+
+static int check(mpc_parser_t* top, const char* when, check_t* cs) {
+  int failures = 0;
+  for (check_t* c = cs; c->input; c++) {
+    mpc_result_t r;
+    const char* got = NULL;
+
+    if (mpc_parse("<test>", c->input, top, &r)) {
+      mpc_ast_t* a = r.output;
+      got = a->children_num > 1 ? a->children[1]->tag : "";
+      got = strstr(got, "first") ? "first" : strstr(got, "second") ? "second" : "";
+      if ((c->tag == NULL) || strcmp(c->tag, got) != 0) { failures++; }
+      mpc_ast_delete(r.output);
+    } else {
+      if (c->tag) { failures++; }
+      mpc_err_delete(r.error);
+    }
+
+    if (failures) {
+      printf("%s: \"%s\" gave %s, expected %s\n", when, c->input,
+	     got ? got : "an error", c->tag ? c->tag : "an error");
+      return failures;
+    }
+  }
+  return 0;
+}
+
+int main(void) {
+  mpc_parser_t* first = mpc_new("first");
+  mpc_parser_t* second = mpc_new("second");
+  mpc_parser_t* top = mpc_new("top");
+  int failures = 0;
+
+  mpc_err_t* e = mpca_lang(MPCA_LANG_DEFAULT, grammar, first, second, top, NULL);
+  if (e) {
+    mpc_err_print(e);
+    mpc_err_delete(e);
+    return 1;
+  }
+
+  check_t before[] = { {"a", "first"}, {"c", "second"}, {"b", NULL}, {NULL, NULL} };
+  failures += check(top, "as defined", before);
+
+  // first now overlaps second, and comes before it
+  mpc_undefine(first);
+  mpca_lang(MPCA_LANG_DEFAULT, " first : 'c' ; ", first, NULL);
+  check_t overlap[] = { {"c", "first"}, {"a", NULL}, {NULL, NULL} };
+  failures += check(top, "after redefining first", overlap);
+
+  // second now starts with a byte the tables never saw
+  mpc_undefine(second);
+  mpca_lang(MPCA_LANG_DEFAULT, " second : 'b' ; ", second, NULL);
+  check_t fresh[] = { {"b", "second"}, {"c", "first"}, {NULL, NULL} };
+  failures += check(top, "after redefining second", fresh);
+
+  // and optimising again picks the new definitions up
+  mpc_optimise(top);
+  failures += check(top, "after optimising again", fresh);
+
+  mpc_cleanup(3, first, second, top);
+  mpc_ast_cleanup();
+
+  printf("redefine: %d failures\n", failures);
+  return failures ? 1 : 0;
+}